@@ -2,6 +2,12 @@
 #include <nabto/nabto_client.h>
 #include <nabto/nabto_client_experimental.h>
 
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <tuple>
+
 namespace nabto {
 namespace client {
 
@@ -622,29 +628,42 @@ class ConnectionImpl : public Connection {
         if (ec) {
             throw NabtoException(ec);
         }
+        std::lock_guard<std::mutex> lock(fingerprintMutex_);
+        clientFingerprint_.clear();
     }
+
+    // The fingerprints are derived by the client library on each call,
+    // they do not change for a given key and device so they are cached.
     std::string getDeviceFingerprintHex()
     {
+        std::lock_guard<std::mutex> lock(fingerprintMutex_);
+        if (!deviceFingerprint_.empty()) {
+            return deviceFingerprint_;
+        }
         char* f;
         auto ec = nabto_client_connection_get_device_fingerprint_hex(connection_, &f);
         if (ec) {
             throw NabtoException(ec);
         }
-        auto str = std::string(f);
+        deviceFingerprint_ = std::string(f);
         nabto_client_string_free(f);
-        return str;
+        return deviceFingerprint_;
     }
 
     std::string getClientFingerprintHex()
     {
+        std::lock_guard<std::mutex> lock(fingerprintMutex_);
+        if (!clientFingerprint_.empty()) {
+            return clientFingerprint_;
+        }
         char* f;
         auto ec = nabto_client_connection_get_client_fingerprint_hex(connection_, &f);
         if (ec) {
             throw NabtoException(ec);
         }
-        auto str = std::string(f);
+        clientFingerprint_ = std::string(f);
         nabto_client_string_free(f);
-        return str;
+        return clientFingerprint_;
     }
 
     void enableDirectCandidates()
@@ -706,8 +725,360 @@ class ConnectionImpl : public Connection {
  private:
     NabtoClientConnection* connection_;
     NabtoClient* context_;
+    std::mutex fingerprintMutex_;
+    std::string deviceFingerprint_;
+    std::string clientFingerprint_;
+};
+
+/**
+ * Future which is resolved by the wrapper instead of by the client
+ * library, used where one result depends on several library futures.
+ */
+class FutureVoidResolvable : public FutureVoid {
+ public:
+    void resolve(Status status)
+    {
+        std::shared_ptr<FutureCallback> cb;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            resolved_ = true;
+            ec_ = status.getErrorCode();
+            cb = cb_;
+            cb_ = nullptr;
+        }
+        cond_.notify_all();
+        if (cb) {
+            cb->run(status);
+        }
+    }
+
+    void waitForResult()
+    {
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            cond_.wait(lock, [this](){ return resolved_; });
+        }
+        getResult();
+    }
+
+    void callback(std::shared_ptr<FutureCallback> cb)
+    {
+        int ec;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!resolved_) {
+                cb_ = cb;
+                return;
+            }
+            ec = ec_;
+        }
+        cb->run(Status(ec));
+    }
+
+    void getResult()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (ec_) {
+            throw NabtoException(ec_);
+        }
+    }
+
+ private:
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    bool resolved_ = false;
+    int ec_ = 0;
+    std::shared_ptr<FutureCallback> cb_;
 };
 
+class CoapBatchImpl : public CoapBatch, public std::enable_shared_from_this<CoapBatchImpl> {
+ public:
+    CoapBatchImpl(std::shared_ptr<Connection> connection, size_t maxOutstanding)
+        : connection_(connection), maxOutstanding_(maxOutstanding == 0 ? 1 : maxOutstanding)
+    {
+    }
+
+    std::shared_ptr<Coap> add(const std::string& method, const std::string& path)
+    {
+        auto coap = connection_->createCoap(method, path);
+        if (!coap) {
+            throw NabtoException(NABTO_CLIENT_EC_UNKNOWN);
+        }
+        std::lock_guard<std::mutex> lock(mutex_);
+        // an executed batch may already be resolved, requests added now
+        // would never be started.
+        if (future_) {
+            throw NabtoException(NABTO_CLIENT_EC_INVALID_STATE);
+        }
+        requests_.push_back(coap);
+        statuses_.push_back(NABTO_CLIENT_EC_OPERATION_IN_PROGRESS);
+        return coap;
+    }
+
+    std::shared_ptr<FutureVoid> execute()
+    {
+        std::vector<size_t> start;
+        std::shared_ptr<FutureVoidResolvable> future;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (future_) {
+                throw NabtoException(NABTO_CLIENT_EC_INVALID_STATE);
+            }
+            future_ = std::make_shared<FutureVoidResolvable>();
+            future = future_;
+            while (next_ < requests_.size() && start.size() < maxOutstanding_) {
+                start.push_back(next_++);
+            }
+        }
+        if (start.empty()) {
+            future->resolve(Status::OK);
+        }
+        for (auto index : start) {
+            startRequest(index);
+        }
+        return future;
+    }
+
+    Status getStatus(size_t index)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return Status(statuses_.at(index));
+    }
+
+    size_t size()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return requests_.size();
+    }
+
+ private:
+    // A request which cannot be started is completed with the error,
+    // which starts the next one in its place. This runs on the library
+    // callback thread, so nothing may be thrown from here.
+    void startRequest(size_t index)
+    {
+        auto self = shared_from_this();
+        for (;;) {
+            std::shared_ptr<Coap> coap;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                coap = requests_[index];
+            }
+            int ec;
+            try {
+                coap->execute()->callback([self, index](Status status) {
+                        self->requestDone(index, status);
+                    });
+                return;
+            } catch (NabtoException& e) {
+                ec = e.status().getErrorCode();
+            } catch (std::exception&) {
+                ec = NABTO_CLIENT_EC_UNKNOWN;
+            }
+            if (!complete(index, Status(ec), index)) {
+                return;
+            }
+        }
+    }
+
+    // Called from the client library thread, each completion starts the
+    // next waiting request so the pipeline stays full.
+    void requestDone(size_t index, Status status)
+    {
+        size_t nextIndex;
+        if (complete(index, status, nextIndex)) {
+            startRequest(nextIndex);
+        }
+    }
+
+    // Record the result of a request and resolve the batch when it was
+    // the last one.
+    //
+    // @return true if nextIndex should be started.
+    bool complete(size_t index, Status status, size_t& nextIndex)
+    {
+        bool startNext = false;
+        bool done = false;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            statuses_[index] = status.getErrorCode();
+            if (!status.ok() && firstError_ == 0) {
+                firstError_ = status.getErrorCode();
+            }
+            completed_++;
+            if (next_ < requests_.size()) {
+                startNext = true;
+                nextIndex = next_++;
+            }
+            done = (completed_ == requests_.size());
+        }
+        if (done) {
+            future_->resolve(Status(firstError_));
+        }
+        return startNext;
+    }
+
+    std::shared_ptr<Connection> connection_;
+    size_t maxOutstanding_;
+    std::mutex mutex_;
+    std::vector<std::shared_ptr<Coap> > requests_;
+    std::vector<int> statuses_;
+    size_t next_ = 0;
+    size_t completed_ = 0;
+    int firstError_ = 0;
+    std::shared_ptr<FutureVoidResolvable> future_;
+};
+
+std::shared_ptr<CoapBatch> CoapBatch::create(std::shared_ptr<Connection> connection, size_t maxOutstanding)
+{
+    return std::make_shared<CoapBatchImpl>(connection, maxOutstanding);
+}
+
+class CoapCacheImpl : public CoapCache {
+ public:
+    CoapCacheImpl(std::shared_ptr<Connection> connection, uint32_t maxAgeMilliseconds)
+        : connection_(connection), maxAge_(maxAgeMilliseconds)
+    {
+    }
+
+    std::shared_ptr<CoapResponse> execute(const std::string& method, const std::string& path)
+    {
+        return execute(method, path, -1, nullptr);
+    }
+
+    std::shared_ptr<CoapResponse> execute(const std::string& method, const std::string& path, int contentFormat, std::shared_ptr<Buffer> payload)
+    {
+        bool cacheable = (method == "GET");
+        Key key = makeKey(method, path, payload);
+        uint64_t generation = 0;
+        if (cacheable) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto it = entries_.find(key);
+            if (it != entries_.end()) {
+                if (std::chrono::steady_clock::now() < it->second.expires) {
+                    hits_++;
+                    return it->second.response;
+                }
+                entries_.erase(it);
+            }
+            misses_++;
+            generation = generation_;
+        } else {
+            clear();
+        }
+
+        std::shared_ptr<CoapResponse> response;
+        try {
+            response = send(method, path, contentFormat, payload);
+        } catch (...) {
+            if (!cacheable) {
+                // the request may have reached the device
+                clear();
+            }
+            throw;
+        }
+
+        if (!cacheable) {
+            // GETs sent while this request was in flight may have
+            // stored a response from before it took effect.
+            clear();
+            return response;
+        }
+        int code = response->getStatusCode();
+        if (code >= 200 && code < 300) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (generation != generation_) {
+                // the cache was cleared or a mutating request was sent
+                // while this GET was in flight, the response may be stale
+                return response;
+            }
+            Entry& entry = entries_[key];
+            entry.response = response;
+            entry.expires = std::chrono::steady_clock::now() + maxAge_;
+        }
+        return response;
+    }
+
+    void invalidate(const std::string& path)
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        generation_++;
+        for (auto it = entries_.begin(); it != entries_.end();) {
+            if (std::get<1>(it->first) == path) {
+                it = entries_.erase(it);
+            } else {
+                it++;
+            }
+        }
+    }
+
+    void clear()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        generation_++;
+        entries_.clear();
+    }
+
+    uint64_t hits()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return hits_;
+    }
+
+    uint64_t misses()
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return misses_;
+    }
+
+ private:
+    // method, path, hash of the request payload
+    typedef std::tuple<std::string, std::string, size_t> Key;
+
+    struct Entry {
+        std::shared_ptr<CoapResponse> response;
+        std::chrono::steady_clock::time_point expires;
+    };
+
+    std::shared_ptr<CoapResponse> send(const std::string& method, const std::string& path, int contentFormat, std::shared_ptr<Buffer> payload)
+    {
+        auto coap = connection_->createCoap(method, path);
+        if (!coap) {
+            throw NabtoException(NABTO_CLIENT_EC_UNKNOWN);
+        }
+        if (payload) {
+            coap->setRequestPayload(contentFormat, payload);
+        }
+        coap->execute()->waitForResult();
+        return std::make_shared<CoapResponse>(coap->getResponseStatusCode(), coap->getResponseContentFormat(), coap->getResponsePayload());
+    }
+
+    static Key makeKey(const std::string& method, const std::string& path, std::shared_ptr<Buffer> payload)
+    {
+        size_t payloadHash = 0;
+        if (payload) {
+            payloadHash = std::hash<std::string>()(std::string((const char*)payload->data(), payload->size()));
+        }
+        return Key(method, path, payloadHash);
+    }
+
+    std::shared_ptr<Connection> connection_;
+    std::chrono::milliseconds maxAge_;
+    std::mutex mutex_;
+    std::map<Key, Entry> entries_;
+    // incremented whenever the cache is cleared or invalidated, a GET
+    // response is only stored if it has not changed since the GET was
+    // sent.
+    uint64_t generation_ = 0;
+    uint64_t hits_ = 0;
+    uint64_t misses_ = 0;
+};
+
+std::shared_ptr<CoapCache> CoapCache::create(std::shared_ptr<Connection> connection, uint32_t maxAgeMilliseconds)
+{
+    return std::make_shared<CoapCacheImpl>(connection, maxAgeMilliseconds);
+}
+
 class LogMessageImpl : public LogMessage {
  public:
     ~LogMessageImpl() {
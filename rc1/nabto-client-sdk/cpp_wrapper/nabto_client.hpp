@@ -217,6 +217,67 @@ class Connection {
     virtual std::shared_ptr<ConnectionEventsListener> createEventsListener() = 0;
 };
 
+/**
+ * Execute many CoAP requests on one connection with at most
+ * maxOutstanding of them in flight at a time, instead of waiting for
+ * each response before sending the next request.
+ *
+ * Requests are added with add() and can be given a payload before
+ * execute() is called. add() and execute() throw NabtoException with
+ * NABTO_CLIENT_EC_INVALID_STATE once the batch has been executed. The
+ * future from execute() resolves when every request has completed, it
+ * fails with the first error if a request failed or could not be
+ * started. The response of each request is read from the Coap returned
+ * by add() and its status from getStatus().
+ */
+class CoapBatch {
+ public:
+    static std::shared_ptr<CoapBatch> create(std::shared_ptr<Connection> connection, size_t maxOutstanding);
+    virtual ~CoapBatch() {}
+    virtual std::shared_ptr<Coap> add(const std::string& method, const std::string& path) = 0;
+    virtual std::shared_ptr<FutureVoid> execute() = 0;
+    virtual Status getStatus(size_t index) = 0;
+    virtual size_t size() = 0;
+};
+
+class CoapResponse {
+ public:
+    CoapResponse(int statusCode, int contentFormat, std::shared_ptr<Buffer> payload)
+        : statusCode_(statusCode), contentFormat_(contentFormat), payload_(payload)
+    {
+    }
+    int getStatusCode() { return statusCode_; }
+    int getContentFormat() { return contentFormat_; }
+    // nullptr if the response has no payload
+    std::shared_ptr<Buffer> getPayload() { return payload_; }
+ private:
+    int statusCode_;
+    int contentFormat_;
+    std::shared_ptr<Buffer> payload_;
+};
+
+/**
+ * Opt-in cache of CoAP GET responses on a connection. Successful (2.xx)
+ * GET responses are kept for maxAgeMilliseconds and served without
+ * contacting the device. Any other method executed through the cache
+ * clears it, since it may change the state behind the cached resources,
+ * and GET responses which were in flight meanwhile are not stored.
+ *
+ * execute() blocks until the response is available and throws
+ * NabtoException if the request fails.
+ */
+class CoapCache {
+ public:
+    static std::shared_ptr<CoapCache> create(std::shared_ptr<Connection> connection, uint32_t maxAgeMilliseconds);
+    virtual ~CoapCache() {}
+    virtual std::shared_ptr<CoapResponse> execute(const std::string& method, const std::string& path) = 0;
+    virtual std::shared_ptr<CoapResponse> execute(const std::string& method, const std::string& path, int contentFormat, std::shared_ptr<Buffer> payload) = 0;
+    virtual void invalidate(const std::string& path) = 0;
+    virtual void clear() = 0;
+    virtual uint64_t hits() = 0;
+    virtual uint64_t misses() = 0;
+};
+
 class Context {
  public:
     // shared_ptr as swig does not understand unique_ptr yet.
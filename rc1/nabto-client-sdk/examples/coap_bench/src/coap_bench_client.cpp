@@ -0,0 +1,357 @@
+#include "nabto_client.hpp"
+#include "bench_options.hpp"
+
+#include <cxxopts.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+const static int CONTENT_FORMAT_APPLICATION_OCTET_STREAM = 42;
+
+struct BenchConfig {
+    BenchOptions common;
+    size_t connections;
+    size_t outstanding;
+    double getRatio;
+    size_t payloadSize;
+    double duration;
+    double warmup;
+    size_t batch;
+    uint32_t cacheMilliseconds;
+};
+
+struct WorkerResult {
+    // request latencies in microseconds
+    std::vector<uint64_t> getLatencies;
+    std::vector<uint64_t> postLatencies;
+    uint64_t errors = 0;
+};
+
+static json run_coap_bench(const BenchConfig& config);
+static void request_loop(std::shared_ptr<nabto::client::Connection> connection, std::shared_ptr<nabto::client::CoapCache> cache, const BenchConfig& config, unsigned seed, std::chrono::steady_clock::time_point measureStart, std::chrono::steady_clock::time_point end, WorkerResult& result);
+static void batch_loop(std::shared_ptr<nabto::client::Connection> connection, const BenchConfig& config, unsigned seed, std::chrono::steady_clock::time_point measureStart, std::chrono::steady_clock::time_point end, WorkerResult& result);
+static json latency_summary(std::vector<uint64_t>& latencies);
+static json device_stats(std::shared_ptr<nabto::client::Connection> connection);
+
+int main(int argc, char** argv)
+{
+    cxxopts::Options options("CoAP bench", "Nabto CoAP request rate benchmark, runs against the coap_bench device.");
+    bench_add_options(options);
+    options.add_options("Workload")
+        ("connections", "Number of nabto connections", cxxopts::value<size_t>()->default_value("1"))
+        ("outstanding", "Number of outstanding requests on each connection", cxxopts::value<size_t>()->default_value("1"))
+        ("get-ratio", "Fraction of the requests which are GET, the rest are POST", cxxopts::value<double>()->default_value("0.8"))
+        ("payload-size", "Size in bytes of the POST payloads", cxxopts::value<size_t>()->default_value("64"))
+        ("duration", "Seconds to measure", cxxopts::value<double>()->default_value("10"))
+        ("warmup", "Seconds to run before measuring", cxxopts::value<double>()->default_value("1"))
+        ("batch", "Send the requests of each worker in batches of this size with CoapBatch, 0 sends them one at a time", cxxopts::value<size_t>()->default_value("0"))
+        ("cache-ms", "Send the requests through a CoapCache per connection which keeps GET responses this long, 0 is no cache", cxxopts::value<uint32_t>()->default_value("0"))
+        ;
+
+    BenchConfig config;
+    try {
+        auto result = options.parse(argc, argv);
+        if (result.count("help")) {
+            std::cout << bench_help(options) << std::endl;
+            exit(0);
+        }
+        if (!bench_parse_options(result, config.common)) {
+            exit(1);
+        }
+        config.connections = result["connections"].as<size_t>();
+        config.outstanding = result["outstanding"].as<size_t>();
+        config.getRatio = result["get-ratio"].as<double>();
+        config.payloadSize = result["payload-size"].as<size_t>();
+        config.duration = result["duration"].as<double>();
+        config.warmup = result["warmup"].as<double>();
+        config.batch = result["batch"].as<size_t>();
+        config.cacheMilliseconds = result["cache-ms"].as<uint32_t>();
+    } catch (...) {
+        std::cout << bench_help(options) << std::endl;
+        exit(1);
+    }
+
+    if (config.connections == 0 || config.outstanding == 0 || config.duration <= 0) {
+        std::cerr << "connections, outstanding and duration must be positive" << std::endl;
+        exit(1);
+    }
+    if (config.batch != 0 && config.cacheMilliseconds != 0) {
+        std::cerr << "batch and cache-ms cannot be combined" << std::endl;
+        exit(1);
+    }
+    if (config.getRatio < 0 || config.getRatio > 1) {
+        std::cerr << "get-ratio must be between 0 and 1" << std::endl;
+        exit(1);
+    }
+
+    json report = run_coap_bench(config);
+    if (!bench_write_report(report, config.common)) {
+        exit(1);
+    }
+    return 0;
+}
+
+json run_coap_bench(const BenchConfig& config)
+{
+    auto ctx = bench_create_context(config.common);
+
+    std::vector<std::shared_ptr<nabto::client::Connection> > connections;
+    try {
+        for (size_t i = 0; i < config.connections; i++) {
+            connections.push_back(bench_connect(ctx, config.common));
+        }
+    } catch (std::exception& e) {
+        std::cerr << "Could not connect to the device: " << e.what() << std::endl;
+        exit(1);
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    auto measureStart = start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(config.warmup));
+    auto end = measureStart + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(config.duration));
+
+    std::vector<std::shared_ptr<nabto::client::CoapCache> > caches(connections.size());
+    if (config.cacheMilliseconds) {
+        for (size_t i = 0; i < connections.size(); i++) {
+            caches[i] = nabto::client::CoapCache::create(connections[i], config.cacheMilliseconds);
+        }
+    }
+
+    // Each worker keeps one request, or one batch, outstanding, so
+    // outstanding workers per connection gives outstanding requests per
+    // connection.
+    std::vector<WorkerResult> results(config.connections * config.outstanding);
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < results.size(); i++) {
+        size_t c = i / config.outstanding;
+        if (config.batch) {
+            threads.push_back(std::thread(batch_loop, connections[c], std::ref(config), (unsigned)i, measureStart, end, std::ref(results[i])));
+        } else {
+            threads.push_back(std::thread(request_loop, connections[c], caches[c], std::ref(config), (unsigned)i, measureStart, end, std::ref(results[i])));
+        }
+    }
+
+    // The device statistics are reset when the measurement starts
+    // such that they only cover the measured period.
+    std::this_thread::sleep_until(measureStart);
+    try {
+        auto coap = connections[0]->createCoap("POST", "/bench/reset");
+        coap->execute()->waitForResult();
+    } catch (std::exception& e) {
+        std::cerr << "Could not reset the device statistics: " << e.what() << std::endl;
+    }
+
+    for (auto& t : threads) {
+        t.join();
+    }
+    auto finished = std::chrono::steady_clock::now();
+
+    json deviceStats = device_stats(connections[0]);
+
+    std::vector<uint64_t> getLatencies;
+    std::vector<uint64_t> postLatencies;
+    std::vector<uint64_t> all;
+    uint64_t errors = 0;
+    for (auto& r : results) {
+        getLatencies.insert(getLatencies.end(), r.getLatencies.begin(), r.getLatencies.end());
+        postLatencies.insert(postLatencies.end(), r.postLatencies.begin(), r.postLatencies.end());
+        errors += r.errors;
+    }
+    all.insert(all.end(), getLatencies.begin(), getLatencies.end());
+    all.insert(all.end(), postLatencies.begin(), postLatencies.end());
+    uint64_t cacheHits = 0;
+    uint64_t cacheMisses = 0;
+    for (auto& cache : caches) {
+        if (cache) {
+            cacheHits += cache->hits();
+            cacheMisses += cache->misses();
+        }
+    }
+
+    for (auto& c : connections) {
+        try {
+            c->close()->waitForResult();
+        } catch (...) {
+        }
+    }
+
+    double elapsed = std::chrono::duration<double>(finished - measureStart).count();
+
+    json report;
+    report["connections"] = config.connections;
+    report["outstandingPerConnection"] = config.outstanding;
+    report["getRatio"] = config.getRatio;
+    report["payloadSize"] = config.payloadSize;
+    report["batch"] = config.batch;
+    report["cacheMilliseconds"] = config.cacheMilliseconds;
+    // include the warmup
+    report["cacheHits"] = cacheHits;
+    report["cacheMisses"] = cacheMisses;
+    report["duration"] = elapsed;
+    report["requests"] = all.size();
+    report["errors"] = errors;
+    report["requestsPerSecond"] = elapsed > 0 ? all.size() / elapsed : 0;
+    report["latencyMicroseconds"] = {
+        {"all", latency_summary(all)},
+        {"get", latency_summary(getLatencies)},
+        {"post", latency_summary(postLatencies)}
+    };
+    report["device"] = deviceStats;
+    return report;
+}
+
+void request_loop(std::shared_ptr<nabto::client::Connection> connection, std::shared_ptr<nabto::client::CoapCache> cache, const BenchConfig& config, unsigned seed, std::chrono::steady_clock::time_point measureStart, std::chrono::steady_clock::time_point end, WorkerResult& result)
+{
+    std::mt19937 rng(seed);
+    std::bernoulli_distribution isGet(config.getRatio);
+    auto payload = std::make_shared<nabto::client::BufferImpl>(std::vector<unsigned char>(config.payloadSize, 'x'));
+
+    for (;;) {
+        auto before = std::chrono::steady_clock::now();
+        if (before >= end) {
+            return;
+        }
+        bool get = isGet(rng);
+        int status = 0;
+        try {
+            if (cache) {
+                auto response = get ?
+                    cache->execute("GET", "/bench/get") :
+                    cache->execute("POST", "/bench/post", CONTENT_FORMAT_APPLICATION_OCTET_STREAM, payload);
+                status = response->getStatusCode();
+            } else {
+                std::shared_ptr<nabto::client::Coap> coap;
+                if (get) {
+                    coap = connection->createCoap("GET", "/bench/get");
+                } else {
+                    coap = connection->createCoap("POST", "/bench/post");
+                    coap->setRequestPayload(CONTENT_FORMAT_APPLICATION_OCTET_STREAM, payload);
+                }
+                coap->execute()->waitForResult();
+                status = coap->getResponseStatusCode();
+            }
+        } catch (std::exception& e) {
+            status = 0;
+        }
+        auto after = std::chrono::steady_clock::now();
+        if (before < measureStart) {
+            continue;
+        }
+        if (status < 200 || status >= 300) {
+            result.errors++;
+            continue;
+        }
+        uint64_t us = std::chrono::duration_cast<std::chrono::microseconds>(after - before).count();
+        if (get) {
+            result.getLatencies.push_back(us);
+        } else {
+            result.postLatencies.push_back(us);
+        }
+    }
+}
+
+void batch_loop(std::shared_ptr<nabto::client::Connection> connection, const BenchConfig& config, unsigned seed, std::chrono::steady_clock::time_point measureStart, std::chrono::steady_clock::time_point end, WorkerResult& result)
+{
+    std::mt19937 rng(seed);
+    std::bernoulli_distribution isGet(config.getRatio);
+    auto payload = std::make_shared<nabto::client::BufferImpl>(std::vector<unsigned char>(config.payloadSize, 'x'));
+
+    for (;;) {
+        auto before = std::chrono::steady_clock::now();
+        if (before >= end) {
+            return;
+        }
+        std::vector<bool> gets;
+        std::vector<std::shared_ptr<nabto::client::Coap> > coaps;
+        std::shared_ptr<nabto::client::CoapBatch> batch;
+        try {
+            // all requests of the batch are outstanding at once
+            batch = nabto::client::CoapBatch::create(connection, config.batch);
+            for (size_t i = 0; i < config.batch; i++) {
+                bool get = isGet(rng);
+                auto coap = get ? batch->add("GET", "/bench/get") : batch->add("POST", "/bench/post");
+                if (!get) {
+                    coap->setRequestPayload(CONTENT_FORMAT_APPLICATION_OCTET_STREAM, payload);
+                }
+                gets.push_back(get);
+                coaps.push_back(coap);
+            }
+            batch->execute()->waitForResult();
+        } catch (std::exception& e) {
+            // failed requests are counted from their status below
+        }
+        auto after = std::chrono::steady_clock::now();
+        if (before < measureStart) {
+            continue;
+        }
+        if (coaps.size() < config.batch) {
+            result.errors += config.batch;
+            continue;
+        }
+        // A request in a batch is done when the whole batch is done.
+        uint64_t us = std::chrono::duration_cast<std::chrono::microseconds>(after - before).count();
+        for (size_t i = 0; i < coaps.size(); i++) {
+            int status = 0;
+            if (batch->getStatus(i).ok()) {
+                status = coaps[i]->getResponseStatusCode();
+            }
+            if (status < 200 || status >= 300) {
+                result.errors++;
+            } else if (gets[i]) {
+                result.getLatencies.push_back(us);
+            } else {
+                result.postLatencies.push_back(us);
+            }
+        }
+    }
+}
+
+json latency_summary(std::vector<uint64_t>& latencies)
+{
+    std::sort(latencies.begin(), latencies.end());
+
+    // Power of two buckets like the device histograms. The client
+    // measures in microseconds, the device in nanoseconds.
+    json histogram = json::array();
+    size_t i = 0;
+    for (uint64_t limit = 1; i < latencies.size(); limit *= 2) {
+        size_t count = 0;
+        while (i < latencies.size() && latencies[i] < limit) {
+            count++;
+            i++;
+        }
+        if (count) {
+            histogram.push_back({{"lessThanMicroseconds", limit}, {"count", count}});
+        }
+    }
+
+    return {
+        {"count", latencies.size()},
+        {"p50", bench_percentile(latencies, 0.50)},
+        {"p99", bench_percentile(latencies, 0.99)},
+        {"p999", bench_percentile(latencies, 0.999)},
+        {"max", latencies.empty() ? 0 : latencies.back()},
+        {"histogram", histogram}
+    };
+}
+
+json device_stats(std::shared_ptr<nabto::client::Connection> connection)
+{
+    try {
+        auto coap = connection->createCoap("GET", "/bench/stats");
+        coap->execute()->waitForResult();
+        auto buffer = coap->getResponsePayload();
+        if (coap->getResponseStatusCode() == 205 && buffer) {
+            return json::parse(std::string(reinterpret_cast<const char*>(buffer->data()), buffer->size()));
+        }
+        std::cerr << "Could not get the device statistics, status: " << coap->getResponseStatusCode() << (buffer ? "" : " without payload") << std::endl;
+    } catch (std::exception& e) {
+        std::cerr << "Could not get the device statistics: " << e.what() << std::endl;
+    }
+    return json();
+}
@@ -0,0 +1,117 @@
+#include "bench_options.hpp"
+#include "direct_connect.hpp"
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+
+#include <sys/resource.h>
+
+void bench_add_options(cxxopts::Options& options)
+{
+    options.add_options()
+        ("h,help", "Shows this help text")
+        ("log-level", "Log level (error|info|trace)", cxxopts::value<std::string>()->default_value(""))
+        ("p,product", "Product id", cxxopts::value<std::string>())
+        ("d,device", "Device id", cxxopts::value<std::string>())
+        ("s,server", "Server url of basestation", cxxopts::value<std::string>()->default_value(""))
+        ("k,server-key", "Key to use with the server", cxxopts::value<std::string>()->default_value(""))
+        ("server-jwt-token", "Optional jwt token to validate the client", cxxopts::value<std::string>()->default_value(""))
+        ;
+    direct_connect_add_options(options, "");
+    options.add_options("Output")
+        ("label", "Label stored in the result, e.g. the SDK release", cxxopts::value<std::string>()->default_value(""))
+        ("o,output", "Write the JSON result to this file instead of stdout", cxxopts::value<std::string>()->default_value(""))
+        ;
+}
+
+std::string bench_help(cxxopts::Options& options)
+{
+    return options.help({"", "Workload", "Output"});
+}
+
+bool bench_parse_options(const cxxopts::ParseResult& result, BenchOptions& options)
+{
+    options.logLevel = result["log-level"].as<std::string>();
+    options.productId = result["product"].as<std::string>();
+    options.deviceId = result["device"].as<std::string>();
+    options.server = result["server"].as<std::string>();
+    options.serverKey = result["server-key"].as<std::string>();
+    options.serverJwtToken = result["server-jwt-token"].as<std::string>();
+    options.label = result["label"].as<std::string>();
+    options.output = result["output"].as<std::string>();
+    return direct_connect_parse_options(result, options.directHost, options.directPort);
+}
+
+// Logs go to stderr as stdout is used for the result.
+class BenchLogger : public nabto::client::Logger
+{
+ public:
+    void log(nabto::client::LogMessage message) {
+        std::cerr << message.getMessage() << std::endl;
+    }
+};
+
+std::shared_ptr<nabto::client::Context> bench_create_context(const BenchOptions& options)
+{
+    auto ctx = nabto::client::Context::create();
+    if (!options.logLevel.empty()) {
+        ctx->setLogger(std::make_shared<BenchLogger>());
+        ctx->setLogLevel(options.logLevel);
+    }
+    return ctx;
+}
+
+std::shared_ptr<nabto::client::Connection> bench_create_connection(std::shared_ptr<nabto::client::Context> ctx, const BenchOptions& options, const std::string& privateKey)
+{
+    auto connection = ctx->createConnection();
+    connection->setProductId(options.productId);
+    connection->setDeviceId(options.deviceId);
+    if (!options.server.empty()) {
+        connection->setServerUrl(options.server);
+        connection->setServerKey(options.serverKey);
+        connection->setServerJwtToken(options.serverJwtToken);
+    }
+    connection->setPrivateKey(privateKey);
+    return connection;
+}
+
+std::shared_ptr<nabto::client::Connection> bench_connect(std::shared_ptr<nabto::client::Context> ctx, const BenchOptions& options)
+{
+    auto connection = bench_create_connection(ctx, options, ctx->createPrivateKey());
+    connect_with_direct_candidate(connection, options.directHost, options.directPort)->waitForResult();
+    return connection;
+}
+
+bool bench_write_report(json& report, const BenchOptions& options)
+{
+    report["label"] = options.label;
+    if (options.output.empty()) {
+        std::cout << report.dump(2) << std::endl;
+        return true;
+    }
+    std::ofstream out(options.output);
+    out << report.dump(2) << std::endl;
+    if (!out) {
+        std::cerr << "Could not write " << options.output << std::endl;
+        return false;
+    }
+    return true;
+}
+
+uint64_t bench_percentile(const std::vector<uint64_t>& sorted, double p)
+{
+    if (sorted.empty()) {
+        return 0;
+    }
+    size_t index = (size_t)(p * (sorted.size() - 1) + 0.5);
+    return sorted[std::min(index, sorted.size() - 1)];
+}
+
+double bench_cpu_seconds()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+        usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
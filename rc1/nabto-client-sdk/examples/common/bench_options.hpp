@@ -0,0 +1,85 @@
+#pragma once
+
+#include <nabto_client.hpp>
+
+#include <cxxopts.hpp>
+#include <nlohmann/json.hpp>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+using json = nlohmann::json;
+
+/**
+ * Options shared by the benchmark clients: how to reach the device and
+ * where the JSON result goes.
+ */
+struct BenchOptions {
+    std::string logLevel;
+    std::string productId;
+    std::string deviceId;
+    std::string server;
+    std::string serverKey;
+    std::string serverJwtToken;
+    std::string directHost;
+    uint16_t directPort = 0;
+    std::string label;
+    std::string output;
+};
+
+/**
+ * Add the shared options. Benchmark specific options go in the
+ * "Workload" group.
+ */
+void bench_add_options(cxxopts::Options& options);
+
+/**
+ * Help text for all the option groups.
+ */
+std::string bench_help(cxxopts::Options& options);
+
+/**
+ * Read the shared options. Throws like cxxopts if a required option is
+ * missing.
+ *
+ * @return false if the options are inconsistent, a reason has been
+ * printed.
+ */
+bool bench_parse_options(const cxxopts::ParseResult& result, BenchOptions& options);
+
+/**
+ * Create a context which logs to stderr if a log level is given,
+ * stdout is used for the result.
+ */
+std::shared_ptr<nabto::client::Context> bench_create_context(const BenchOptions& options);
+
+/**
+ * Create a connection to the device with the given private key without
+ * connecting it.
+ */
+std::shared_ptr<nabto::client::Connection> bench_create_connection(std::shared_ptr<nabto::client::Context> ctx, const BenchOptions& options, const std::string& privateKey);
+
+/**
+ * Create a connection with a new private key and wait for it to
+ * connect. Throws if the connect fails.
+ */
+std::shared_ptr<nabto::client::Connection> bench_connect(std::shared_ptr<nabto::client::Context> ctx, const BenchOptions& options);
+
+/**
+ * Set the label on the report and write it to stdout or the output
+ * file.
+ *
+ * @return false if the output file could not be written.
+ */
+bool bench_write_report(json& report, const BenchOptions& options);
+
+/**
+ * The p'th percentile, 0 <= p <= 1, of sorted values, 0 if empty.
+ */
+uint64_t bench_percentile(const std::vector<uint64_t>& sorted, double p);
+
+/**
+ * User and system cpu time used by this process.
+ */
+double bench_cpu_seconds();
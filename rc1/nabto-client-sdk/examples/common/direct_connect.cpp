@@ -0,0 +1,38 @@
+#include "direct_connect.hpp"
+
+#include <iostream>
+
+void direct_connect_add_options(cxxopts::Options& options, const std::string& group)
+{
+    options.add_options(group)
+        ("direct-host", "Host or ip of the device for a direct connection without a basestation", cxxopts::value<std::string>()->default_value(""))
+        ("direct-port", "Local port of the device for a direct connection, required with --direct-host", cxxopts::value<uint16_t>())
+        ;
+}
+
+bool direct_connect_parse_options(const cxxopts::ParseResult& result, std::string& directHost, uint16_t& directPort)
+{
+    directHost = result["direct-host"].as<std::string>();
+    directPort = 0;
+    if (result.count("direct-port")) {
+        directPort = result["direct-port"].as<uint16_t>();
+    } else if (!directHost.empty()) {
+        std::cerr << "--direct-port is required with --direct-host, use the --local-port given to the device" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+std::shared_ptr<nabto::client::FutureVoid> connect_with_direct_candidate(std::shared_ptr<nabto::client::Connection> connection, const std::string& directHost, uint16_t directPort)
+{
+    if (directHost.empty()) {
+        return connection->connect();
+    }
+    // Direct candidates has to be enabled before connect and added
+    // after connect has been called.
+    connection->enableDirectCandidates();
+    auto future = connection->connect();
+    connection->addDirectCandidate(directHost, directPort);
+    connection->endOfDirectCandidates();
+    return future;
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <nabto_client.hpp>
+
+#include <cxxopts.hpp>
+
+#include <memory>
+#include <string>
+
+/**
+ * Start connecting a connection. If directHost is not empty the
+ * device is also tried directly on directHost:directPort, this makes
+ * it possible to connect to a device on the local network or the
+ * same machine without a basestation.
+ *
+ * @return future which resolves when the connection is established or failed.
+ */
+/**
+ * Add the --direct-host and --direct-port options to the group.
+ */
+void direct_connect_add_options(cxxopts::Options& options, const std::string& group);
+
+/**
+ * Read the --direct-host and --direct-port options. The devices use an
+ * ephemeral local port unless they are started with --local-port, so
+ * there is no default port and it is required with a host.
+ *
+ * @return false if a host is given without a port, a reason has been
+ * printed.
+ */
+bool direct_connect_parse_options(const cxxopts::ParseResult& result, std::string& directHost, uint16_t& directPort);
+
+std::shared_ptr<nabto::client::FutureVoid> connect_with_direct_candidate(std::shared_ptr<nabto::client::Connection> connection, const std::string& directHost, uint16_t directPort);
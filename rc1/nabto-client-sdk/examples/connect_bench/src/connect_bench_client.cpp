@@ -0,0 +1,262 @@
+#include "nabto_client.hpp"
+#include "direct_connect.hpp"
+#include "bench_options.hpp"
+
+#include <cxxopts.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+struct BenchConfig {
+    BenchOptions common;
+    size_t connects;
+    size_t parallel;
+    bool freshKeys;
+    std::string coapPath;
+    int devicePid;
+};
+
+/**
+ * Time spent in each phase of one connect, in microseconds.
+ */
+struct ConnectSample {
+    uint64_t keygen = 0;
+    uint64_t setup = 0;
+    uint64_t connect = 0;
+    uint64_t firstRequest = 0;
+    uint64_t close = 0;
+    uint64_t total = 0;
+};
+
+struct WorkerResult {
+    std::vector<ConnectSample> samples;
+    uint64_t failures = 0;
+};
+
+static json run_connect_bench(const BenchConfig& config);
+static void connect_loop(std::shared_ptr<nabto::client::Context> ctx, const BenchConfig& config, const std::string& sharedKey, std::atomic<size_t>& remaining, WorkerResult& result);
+static json phase_summary(std::vector<uint64_t> values);
+static double process_cpu_seconds(int pid);
+
+int main(int argc, char** argv)
+{
+    cxxopts::Options options("Connect bench", "Nabto connection establishment benchmark.");
+    bench_add_options(options);
+    options.add_options("Workload")
+        ("connects", "Total number of connections to open and close", cxxopts::value<size_t>()->default_value("1000"))
+        ("parallel", "Number of connects in progress at the same time", cxxopts::value<size_t>()->default_value("1"))
+        ("fresh-keys", "Create a new private key for every connection instead of reusing one")
+        ("coap-path", "Optional GET request made on each connection, e.g. /bench/get", cxxopts::value<std::string>()->default_value(""))
+        ("device-pid", "Pid of a local device process, its cpu time is included in the result", cxxopts::value<int>()->default_value("0"))
+        ;
+
+    BenchConfig config;
+    try {
+        auto result = options.parse(argc, argv);
+        if (result.count("help")) {
+            std::cout << bench_help(options) << std::endl;
+            exit(0);
+        }
+        if (!bench_parse_options(result, config.common)) {
+            exit(1);
+        }
+        config.connects = result["connects"].as<size_t>();
+        config.parallel = result["parallel"].as<size_t>();
+        config.freshKeys = result.count("fresh-keys") > 0;
+        config.coapPath = result["coap-path"].as<std::string>();
+        config.devicePid = result["device-pid"].as<int>();
+    } catch (...) {
+        std::cout << bench_help(options) << std::endl;
+        exit(1);
+    }
+
+    if (config.connects == 0 || config.parallel == 0) {
+        std::cerr << "connects and parallel must be positive" << std::endl;
+        exit(1);
+    }
+
+    json report = run_connect_bench(config);
+    if (!bench_write_report(report, config.common)) {
+        exit(1);
+    }
+    return 0;
+}
+
+json run_connect_bench(const BenchConfig& config)
+{
+    auto ctx = bench_create_context(config.common);
+
+    std::string sharedKey;
+    if (!config.freshKeys) {
+        sharedKey = ctx->createPrivateKey();
+    }
+
+    std::atomic<size_t> remaining(config.connects);
+    std::vector<WorkerResult> results(config.parallel);
+    std::vector<std::thread> threads;
+
+    double cpuStart = bench_cpu_seconds();
+    double deviceCpuStart = process_cpu_seconds(config.devicePid);
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < config.parallel; i++) {
+        threads.push_back(std::thread(connect_loop, ctx, std::ref(config), std::ref(sharedKey), std::ref(remaining), std::ref(results[i])));
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    double cpuUsed = bench_cpu_seconds() - cpuStart;
+    double deviceCpuUsed = process_cpu_seconds(config.devicePid) - deviceCpuStart;
+
+    std::vector<ConnectSample> samples;
+    uint64_t failures = 0;
+    for (auto& r : results) {
+        samples.insert(samples.end(), r.samples.begin(), r.samples.end());
+        failures += r.failures;
+    }
+
+    auto phase = [&samples](uint64_t ConnectSample::* member) {
+        std::vector<uint64_t> values;
+        for (auto& s : samples) {
+            values.push_back(s.*member);
+        }
+        return phase_summary(values);
+    };
+
+    json report;
+    report["connects"] = samples.size();
+    report["failures"] = failures;
+    report["parallel"] = config.parallel;
+    report["freshKeys"] = config.freshKeys;
+    report["directCandidate"] = !config.common.directHost.empty();
+    report["duration"] = elapsed;
+    report["connectsPerSecond"] = elapsed > 0 ? samples.size() / elapsed : 0;
+    report["clientCpuSecondsPerConnect"] = samples.empty() ? 0 : cpuUsed / samples.size();
+    if (config.devicePid != 0) {
+        report["deviceCpuSecondsPerConnect"] = samples.empty() ? 0 : deviceCpuUsed / samples.size();
+    }
+    json phases;
+    if (config.freshKeys) {
+        phases["keygen"] = phase(&ConnectSample::keygen);
+    }
+    phases["setup"] = phase(&ConnectSample::setup);
+    phases["connect"] = phase(&ConnectSample::connect);
+    if (!config.coapPath.empty()) {
+        phases["firstRequest"] = phase(&ConnectSample::firstRequest);
+    }
+    phases["close"] = phase(&ConnectSample::close);
+    phases["total"] = phase(&ConnectSample::total);
+    report["phasesMicroseconds"] = phases;
+    return report;
+}
+
+static uint64_t micros_since(std::chrono::steady_clock::time_point& last)
+{
+    auto now = std::chrono::steady_clock::now();
+    uint64_t us = std::chrono::duration_cast<std::chrono::microseconds>(now - last).count();
+    last = now;
+    return us;
+}
+
+void connect_loop(std::shared_ptr<nabto::client::Context> ctx, const BenchConfig& config, const std::string& sharedKey, std::atomic<size_t>& remaining, WorkerResult& result)
+{
+    for (;;) {
+        size_t left = remaining.load();
+        do {
+            if (left == 0) {
+                return;
+            }
+        } while (!remaining.compare_exchange_weak(left, left - 1));
+
+        ConnectSample sample;
+        auto begin = std::chrono::steady_clock::now();
+        auto last = begin;
+        try {
+            std::string privateKey = sharedKey;
+            if (config.freshKeys) {
+                privateKey = ctx->createPrivateKey();
+                sample.keygen = micros_since(last);
+            }
+
+            auto connection = bench_create_connection(ctx, config.common, privateKey);
+            sample.setup = micros_since(last);
+
+            connect_with_direct_candidate(connection, config.common.directHost, config.common.directPort)->waitForResult();
+            sample.connect = micros_since(last);
+
+            if (!config.coapPath.empty()) {
+                auto coap = connection->createCoap("GET", config.coapPath);
+                coap->execute()->waitForResult();
+                sample.firstRequest = micros_since(last);
+            }
+
+            connection->close()->waitForResult();
+            sample.close = micros_since(last);
+        } catch (std::exception& e) {
+            result.failures++;
+            continue;
+        }
+        sample.total = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - begin).count();
+        result.samples.push_back(sample);
+    }
+}
+
+json phase_summary(std::vector<uint64_t> values)
+{
+    std::sort(values.begin(), values.end());
+    uint64_t sum = 0;
+    for (auto v : values) {
+        sum += v;
+    }
+    return {
+        {"mean", values.empty() ? 0 : (double)sum / values.size()},
+        {"p50", bench_percentile(values, 0.50)},
+        {"p99", bench_percentile(values, 0.99)},
+        {"max", values.empty() ? 0 : values.back()}
+    };
+}
+
+/**
+ * Cpu time of another process on this machine, read from
+ * /proc/<pid>/stat. Returns 0 if pid is 0 or the process cannot be
+ * read.
+ */
+double process_cpu_seconds(int pid)
+{
+    if (pid == 0) {
+        return 0;
+    }
+    std::ifstream in("/proc/" + std::to_string(pid) + "/stat");
+    std::string stat;
+    if (!std::getline(in, stat)) {
+        return 0;
+    }
+    // the process name can contain spaces, the fields after it are
+    // space separated. utime and stime are field 14 and 15.
+    size_t end = stat.rfind(')');
+    if (end == std::string::npos) {
+        return 0;
+    }
+    std::istringstream fields(stat.substr(end + 2));
+    std::string field;
+    uint64_t utime = 0;
+    uint64_t stime = 0;
+    for (int i = 3; i <= 15 && fields >> field; i++) {
+        if (i == 14) {
+            utime = std::stoull(field);
+        } else if (i == 15) {
+            stime = std::stoull(field);
+        }
+    }
+    return (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+}
@@ -0,0 +1,219 @@
+#include "nabto_client.hpp"
+#include "bench_options.hpp"
+
+#include <cxxopts.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/resource.h>
+
+struct BenchConfig {
+    BenchOptions common;
+    size_t connections;
+    size_t streams;
+    size_t messageSize;
+    double duration;
+    double warmup;
+};
+
+struct StreamResult {
+    // echo latencies in microseconds
+    std::vector<uint64_t> latencies;
+    uint64_t bytes = 0;
+    bool failed = false;
+};
+
+static json run_stream_bench(const BenchConfig& config);
+static void echo_loop(std::shared_ptr<nabto::client::Stream> stream, size_t messageSize, std::chrono::steady_clock::time_point measureStart, std::chrono::steady_clock::time_point end, StreamResult& result);
+
+int main(int argc, char** argv)
+{
+    cxxopts::Options options("Stream bench", "Nabto stream throughput and latency benchmark, runs against the stream_echo device.");
+    bench_add_options(options);
+    options.add_options("Workload")
+        ("connections", "Number of nabto connections", cxxopts::value<size_t>()->default_value("1"))
+        ("streams", "Number of concurrent echo streams on each connection", cxxopts::value<size_t>()->default_value("1"))
+        ("message-size", "Size in bytes of each echoed message", cxxopts::value<size_t>()->default_value("1024"))
+        ("duration", "Seconds to measure", cxxopts::value<double>()->default_value("10"))
+        ("warmup", "Seconds to run before measuring", cxxopts::value<double>()->default_value("1"))
+        ;
+
+    BenchConfig config;
+    try {
+        auto result = options.parse(argc, argv);
+        if (result.count("help")) {
+            std::cout << bench_help(options) << std::endl;
+            exit(0);
+        }
+        if (!bench_parse_options(result, config.common)) {
+            exit(1);
+        }
+        config.connections = result["connections"].as<size_t>();
+        config.streams = result["streams"].as<size_t>();
+        config.messageSize = result["message-size"].as<size_t>();
+        config.duration = result["duration"].as<double>();
+        config.warmup = result["warmup"].as<double>();
+    } catch (...) {
+        std::cout << bench_help(options) << std::endl;
+        exit(1);
+    }
+
+    if (config.connections == 0 || config.streams == 0 || config.messageSize == 0 || config.duration <= 0) {
+        std::cerr << "connections, streams, message-size and duration must be positive" << std::endl;
+        exit(1);
+    }
+
+    json report = run_stream_bench(config);
+    if (!bench_write_report(report, config.common)) {
+        exit(1);
+    }
+    return (report["failedStreams"].get<size_t>() == 0 && report["rejectedStreams"].get<size_t>() == 0) ? 0 : 1;
+}
+
+json run_stream_bench(const BenchConfig& config)
+{
+    auto ctx = bench_create_context(config.common);
+
+    std::vector<std::shared_ptr<nabto::client::Connection> > connections;
+    std::vector<std::shared_ptr<nabto::client::Stream> > streams;
+    try {
+        for (size_t i = 0; i < config.connections; i++) {
+            connections.push_back(bench_connect(ctx, config.common));
+        }
+    } catch (std::exception& e) {
+        std::cerr << "Could not set up the benchmark: " << e.what() << std::endl;
+        exit(1);
+    }
+    // The connection is up, so a stream which cannot be opened has been
+    // rejected by the device. The benchmark runs with the accepted
+    // streams and reports the rejected ones.
+    size_t rejected = 0;
+    for (auto& connection : connections) {
+        for (size_t j = 0; j < config.streams; j++) {
+            auto stream = connection->createStream();
+            try {
+                stream->open(42)->waitForResult();
+                streams.push_back(stream);
+            } catch (std::exception&) {
+                rejected++;
+            }
+        }
+    }
+    if (rejected) {
+        std::cerr << "The device rejected " << rejected << " of " << config.connections * config.streams << " streams. "
+                  << "The stream_echo device allows --max-streams-per-connection (default 4) streams on each connection "
+                  << "and --max-streams (default 16) in total." << std::endl;
+    }
+
+    std::vector<StreamResult> results(streams.size());
+    std::vector<std::thread> threads;
+
+    auto start = std::chrono::steady_clock::now();
+    auto measureStart = start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(config.warmup));
+    auto end = measureStart + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(config.duration));
+
+    // cpu time is sampled around the measured period only.
+    for (size_t i = 0; i < streams.size(); i++) {
+        threads.push_back(std::thread(echo_loop, streams[i], config.messageSize, measureStart, end, std::ref(results[i])));
+    }
+    std::this_thread::sleep_until(measureStart);
+    double cpuStart = bench_cpu_seconds();
+    for (auto& t : threads) {
+        t.join();
+    }
+    double cpuUsed = bench_cpu_seconds() - cpuStart;
+    auto finished = std::chrono::steady_clock::now();
+
+    std::vector<uint64_t> latencies;
+    uint64_t bytes = 0;
+    size_t failed = 0;
+    for (auto& r : results) {
+        latencies.insert(latencies.end(), r.latencies.begin(), r.latencies.end());
+        bytes += r.bytes;
+        if (r.failed) {
+            failed++;
+        }
+    }
+    std::sort(latencies.begin(), latencies.end());
+
+    for (auto& s : streams) {
+        try {
+            s->close()->waitForResult();
+        } catch (...) {
+            // the result is already recorded
+        }
+    }
+    for (auto& c : connections) {
+        try {
+            c->close()->waitForResult();
+        } catch (...) {
+        }
+    }
+
+    double elapsed = std::chrono::duration<double>(finished - measureStart).count();
+    double gigabytes = (double)bytes / 1e9;
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    json report;
+    report["connections"] = config.connections;
+    report["streamsPerConnection"] = config.streams;
+    report["messageSize"] = config.messageSize;
+    report["duration"] = elapsed;
+    report["messages"] = latencies.size();
+    report["bytes"] = bytes;
+    report["throughputBytesPerSecond"] = elapsed > 0 ? bytes / elapsed : 0;
+    report["messagesPerSecond"] = elapsed > 0 ? latencies.size() / elapsed : 0;
+    report["latencyMicroseconds"] = {
+        {"p50", bench_percentile(latencies, 0.50)},
+        {"p99", bench_percentile(latencies, 0.99)},
+        {"p999", bench_percentile(latencies, 0.999)},
+        {"max", latencies.empty() ? 0 : latencies.back()}
+    };
+    report["cpuSeconds"] = cpuUsed;
+    report["cpuSecondsPerGB"] = gigabytes > 0 ? cpuUsed / gigabytes : 0;
+    // ru_maxrss is in kilobytes on linux
+    report["maxRssKilobytes"] = usage.ru_maxrss;
+    report["failedStreams"] = failed;
+    report["rejectedStreams"] = rejected;
+    return report;
+}
+
+void echo_loop(std::shared_ptr<nabto::client::Stream> stream, size_t messageSize, std::chrono::steady_clock::time_point measureStart, std::chrono::steady_clock::time_point end, StreamResult& result)
+{
+    std::vector<unsigned char> message(messageSize);
+    for (size_t i = 0; i < messageSize; i++) {
+        message[i] = (unsigned char)i;
+    }
+    auto buffer = std::make_shared<nabto::client::BufferImpl>(message);
+    try {
+        for (;;) {
+            auto before = std::chrono::steady_clock::now();
+            if (before >= end) {
+                return;
+            }
+            stream->write(buffer)->waitForResult();
+            auto echo = stream->readAll(messageSize)->waitForResult();
+            auto after = std::chrono::steady_clock::now();
+            if (echo->size() != messageSize || !std::equal(message.begin(), message.end(), echo->data())) {
+                std::cerr << "Echoed data does not match the written data" << std::endl;
+                result.failed = true;
+                return;
+            }
+            if (before >= measureStart) {
+                result.latencies.push_back(std::chrono::duration_cast<std::chrono::microseconds>(after - before).count());
+                result.bytes += messageSize;
+            }
+        }
+    } catch (std::exception& e) {
+        std::cerr << "Stream failed: " << e.what() << std::endl;
+        result.failed = true;
+    }
+}
@@ -1,4 +1,5 @@
 #include "nabto_client.hpp"
+#include "direct_connect.hpp"
 
 #include <cxxopts.hpp>
 
@@ -10,7 +11,7 @@
 #include <thread>
 
 static void reader(std::shared_ptr<nabto::client::Stream> stream);
-static void run_stream_echo_client(const std::string& logLevel, const std::string& productId, const std::string& deviceId, const std::string& server, const std::string& serverKey, const std::string& serverJwtToken);
+static void run_stream_echo_client(const std::string& logLevel, const std::string& productId, const std::string& deviceId, const std::string& server, const std::string& serverKey, const std::string& serverJwtToken, const std::string& directHost, uint16_t directPort);
 
 
 int main(int argc, char** argv)
@@ -23,10 +24,11 @@ int main(int argc, char** argv)
         ("log-level", "Log level (error|info|trace)", cxxopts::value<std::string>()->default_value(""))
         ("p,product", "Product id", cxxopts::value<std::string>())
         ("d,device", "Device id", cxxopts::value<std::string>())
-        ("s,server", "Server url of basestation", cxxopts::value<std::string>())
-        ("k,server-key", "Key to use with the server", cxxopts::value<std::string>())
+        ("s,server", "Server url of basestation", cxxopts::value<std::string>()->default_value(""))
+        ("k,server-key", "Key to use with the server", cxxopts::value<std::string>()->default_value(""))
         ("server-jwt-token", "Optional jwt token to validate the client", cxxopts::value<std::string>()->default_value(""))
         ;
+    direct_connect_add_options(options, "Options");
 
 
     auto result = options.parse(argc, argv);
@@ -36,13 +38,21 @@ int main(int argc, char** argv)
         exit(0);
     }
 
+    std::string directHost;
+    uint16_t directPort;
+    if (!direct_connect_parse_options(result, directHost, directPort)) {
+        exit(1);
+    }
+
     try {
         run_stream_echo_client(result["log-level"].as<std::string>(),
                                result["product"].as<std::string>(),
                                result["device"].as<std::string>(),
                                result["server"].as<std::string>(),
                                result["server-key"].as<std::string>(),
-                               result["server-jwt-token"].as<std::string>());
+                               result["server-jwt-token"].as<std::string>(),
+                               directHost,
+                               directPort);
     } catch(...) {
         std::cout << options.help() << std::endl;
         exit(1);
@@ -57,7 +67,7 @@ class MyLogger : public nabto::client::Logger
     }
 };
 
-void run_stream_echo_client(const std::string& logLevel, const std::string& productId, const std::string& deviceId, const std::string& server, const std::string& serverKey, const std::string& serverJwtToken)
+void run_stream_echo_client(const std::string& logLevel, const std::string& productId, const std::string& deviceId, const std::string& server, const std::string& serverKey, const std::string& serverJwtToken, const std::string& directHost, uint16_t directPort)
 {
     auto ctx = nabto::client::Context::create();
     if (!logLevel.empty()) {
@@ -68,14 +78,17 @@ void run_stream_echo_client(const std::string& logLevel, const std::string& prod
     auto connection = ctx->createConnection();
     connection->setProductId(productId);
     connection->setDeviceId(deviceId);
-    connection->setServerUrl(server);
-    connection->setServerKey(serverKey);
+    // A direct connection does not need a basestation.
+    if (!server.empty()) {
+        connection->setServerUrl(server);
+        connection->setServerKey(serverKey);
+        connection->setServerJwtToken(serverJwtToken);
+    }
     std::string privateKey = ctx->createPrivateKey();
     connection->setPrivateKey(privateKey);
-    connection->setServerJwtToken(serverJwtToken);
 
     try {
-        connection->connect()->waitForResult();
+        connect_with_direct_candidate(connection, directHost, directPort)->waitForResult();
     } catch (std::exception& e) {
         std::cout << "Connect failed" << e.what() << std::endl;
         exit(1);
@@ -1,6 +1,7 @@
 #include "nabto_client.hpp"
 #include "json_config.hpp"
 #include "timestamp.hpp"
+#include "tunnel_limiter.hpp"
 
 #include <cxxopts.hpp>
 #include <nlohmann/json.hpp>
@@ -61,7 +62,7 @@ std::shared_ptr<nabto::client::Connection> createConnection(std::shared_ptr<nabt
     return connection;
 }
 
-void tcptunnel(const std::string& logLevel, const std::string& configFile, uint16_t localPort, const std::string& remoteHost, uint16_t remotePort)
+void tcptunnel(const std::string& logLevel, const std::string& configFile, uint16_t localPort, const std::string& remoteHost, uint16_t remotePort, const TunnelLimits& limits)
 {
     std::cout << "Creating tunnel " << configFile << " local port " << localPort << " remote host " << remoteHost << " remote port " << remotePort << std::endl;
 
@@ -69,10 +70,36 @@ void tcptunnel(const std::string& logLevel, const std::string& configFile, uint1
 
     auto connection = createConnection(ctx, logLevel, configFile);
 
+    std::unique_ptr<TunnelLimiter> limiter;
+    uint16_t tunnelPort = localPort;
+    if (limits.enabled()) {
+        // The tunnel listens on a private port and the limiter takes
+        // the local port the user asked for.
+        limiter = std::make_unique<TunnelLimiter>(limits);
+        if (!limiter->listen(localPort)) {
+            std::cerr << "Could not listen on local port " << localPort << std::endl;
+            exit(1);
+        }
+        // the client library chooses the port of the tunnel listener
+        tunnelPort = 0;
+        limiter->rememberListeners();
+    }
+
     auto tunnel = connection->createTcpTunnel();
-    tunnel->open(localPort, remoteHost, remotePort)->waitForResult();
+    tunnel->open(tunnelPort, remoteHost, remotePort)->waitForResult();
     std::cout << "tunnel is opened" << std::endl;
 
+    if (limiter) {
+        if (!limiter->start()) {
+            std::cerr << "Could not restrict the tunnel listener to the limiter" << std::endl;
+            exit(1);
+        }
+        std::cout << "limiting tunnel on local port " << limiter->getLocalPort()
+                  << " max connections " << limits.maxConnections
+                  << " connection rate " << limits.connectionRate
+                  << " total rate " << limits.totalRate << std::endl;
+    }
+
     // wait for ctrl c
     struct sigaction sigIntHandler;
 
@@ -84,6 +111,9 @@ void tcptunnel(const std::string& logLevel, const std::string& configFile, uint1
 
     pause();
 
+    if (limiter) {
+        limiter->stop();
+    }
     connection->close();
 }
 
@@ -185,7 +215,10 @@ int main(int argc, char** argv)
     options.add_options("TCPTunnelling")
         ("local-port", "Local port to bind tcp listener to", cxxopts::value<uint16_t>()->default_value("0"))
         ("remote-host", "Remote ip to connect to", cxxopts::value<std::string>()->default_value(""))
-        ("remote-port", "Remote port to connect to", cxxopts::value<uint16_t>()->default_value("0"));
+        ("remote-port", "Remote port to connect to", cxxopts::value<uint16_t>()->default_value("0"))
+        ("max-connections", "Max concurrent tcp connections through the tunnel, 0 is unlimited", cxxopts::value<size_t>()->default_value("0"))
+        ("connection-rate", "Max bytes per second for each tcp connection, 0 is unlimited", cxxopts::value<uint64_t>()->default_value("0"))
+        ("total-rate", "Max bytes per second for all tcp connections, 0 is unlimited", cxxopts::value<uint64_t>()->default_value("0"));
 
     auto result = options.parse(argc, argv);
     if (result.count("help"))
@@ -210,11 +243,16 @@ int main(int argc, char** argv)
         }
     } else if (result.count("tcptunnel")) {
         try {
+            TunnelLimits limits;
+            limits.maxConnections = result["max-connections"].as<size_t>();
+            limits.connectionRate = result["connection-rate"].as<uint64_t>();
+            limits.totalRate = result["total-rate"].as<uint64_t>();
             tcptunnel(result["log-level"].as<std::string>(),
                       result["config"].as<std::string>(),
                       result["local-port"].as<uint16_t>(),
                       result["remote-host"].as<std::string>(),
-                      result["remote-port"].as<uint16_t>());
+                      result["remote-port"].as<uint16_t>(),
+                      limits);
         } catch (const std::exception& e) {
             std::cout << e.what() << std::endl;
             exit(1);
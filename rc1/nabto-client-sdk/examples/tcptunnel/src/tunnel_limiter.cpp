@@ -0,0 +1,590 @@
+#include "tunnel_limiter.hpp"
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/filter.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+static const size_t BUFFER_SIZE = 16384;
+// Up to 16 instructions check the source address, then two per allowed
+// port, see updateFilter.
+static const size_t MAX_FILTER_PORTS = (BPF_MAXINSNS - 18) / 2;
+// Poll interval when a connection is waiting for rate limit tokens.
+static const int THROTTLE_INTERVAL_MS = 10;
+static const int IDLE_INTERVAL_MS = 100;
+
+static bool set_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    return flags != -1 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+struct ProcessListener {
+    int fd;
+    int family;
+    uint16_t port;
+};
+
+struct ProcTcpEntry {
+    uint16_t localPort;
+    bool listening;
+    unsigned long inode;
+};
+
+/**
+ * The tcp sockets in /proc/self/net/tcp or tcp6, that is in the network
+ * namespace of this process.
+ */
+static std::vector<ProcTcpEntry> read_tcp_entries(const char* file)
+{
+    std::vector<ProcTcpEntry> entries;
+    std::ifstream in(file);
+    std::string line;
+    // skip the header
+    std::getline(in, line);
+    while (std::getline(in, line)) {
+        std::istringstream fields(line);
+        std::string sl, local, remote, state, queues, timer, retransmits, uid, timeout;
+        unsigned long inode;
+        if (!(fields >> sl >> local >> remote >> state >> queues >> timer >> retransmits >> uid >> timeout >> inode)) {
+            continue;
+        }
+        size_t colon = local.find(':');
+        if (colon == std::string::npos) {
+            continue;
+        }
+        entries.push_back(ProcTcpEntry{(uint16_t)std::stoul(local.substr(colon + 1), NULL, 16), state == "0A", inode});
+    }
+    return entries;
+}
+
+/**
+ * Add the tcp sockets in LISTEN state from /proc/self/net/tcp or tcp6
+ * which are open in this process.
+ */
+static void read_listeners(const char* file, int family, const std::map<unsigned long, int>& fds, std::map<unsigned long, ProcessListener>& listeners)
+{
+    for (auto& e : read_tcp_entries(file)) {
+        auto fd = fds.find(e.inode);
+        if (e.listening && fd != fds.end()) {
+            listeners[e.inode] = ProcessListener{fd->second, family, e.localPort};
+        }
+    }
+}
+
+/**
+ * True if any tcp socket which is not listening has the given local
+ * port, i.e. someone has connected to the listener on that port.
+ */
+static bool has_connections(uint16_t port)
+{
+    for (const char* file : { "/proc/self/net/tcp", "/proc/self/net/tcp6" }) {
+        for (auto& e : read_tcp_entries(file)) {
+            if (!e.listening && e.localPort == port) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+/**
+ * The listening tcp sockets of this process by inode.
+ */
+static std::map<unsigned long, ProcessListener> process_listeners()
+{
+    std::map<unsigned long, int> fds;
+    DIR* dir = opendir("/proc/self/fd");
+    if (dir == NULL) {
+        return {};
+    }
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        std::string path = std::string("/proc/self/fd/") + entry->d_name;
+        char target[64];
+        ssize_t n = readlink(path.c_str(), target, sizeof(target) - 1);
+        if (n <= 0) {
+            continue;
+        }
+        target[n] = 0;
+        unsigned long inode;
+        if (sscanf(target, "socket:[%lu]", &inode) == 1) {
+            fds[inode] = atoi(entry->d_name);
+        }
+    }
+    closedir(dir);
+
+    std::map<unsigned long, ProcessListener> listeners;
+    read_listeners("/proc/self/net/tcp", AF_INET, fds, listeners);
+    read_listeners("/proc/self/net/tcp6", AF_INET6, fds, listeners);
+    return listeners;
+}
+
+static socklen_t loopback_address(int family, uint16_t port, struct sockaddr_storage& storage)
+{
+    storage = {};
+    if (family == AF_INET6) {
+        struct sockaddr_in6* addr = (struct sockaddr_in6*)&storage;
+        addr->sin6_family = AF_INET6;
+        addr->sin6_addr = in6addr_loopback;
+        addr->sin6_port = htons(port);
+        return sizeof(*addr);
+    }
+    struct sockaddr_in* addr = (struct sockaddr_in*)&storage;
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr->sin_port = htons(port);
+    return sizeof(*addr);
+}
+
+static double burst(uint64_t rate)
+{
+    // allow 100ms worth of data in one go, but at least a full packet
+    return std::max((double)rate / 10.0, 1500.0);
+}
+
+TunnelLimiter::TunnelLimiter(const TunnelLimits& limits)
+    : limits_(limits), totalTokens_(burst(limits.totalRate)), stopped_(false)
+{
+}
+
+TunnelLimiter::~TunnelLimiter()
+{
+    stop();
+    for (auto& s : sessions_) {
+        closeSession(*s);
+    }
+    if (listenFd_ != -1) {
+        close(listenFd_);
+    }
+}
+
+bool TunnelLimiter::listen(uint16_t port)
+{
+    listenFd_ = socket(AF_INET, SOCK_STREAM, 0);
+    if (listenFd_ == -1) {
+        return false;
+    }
+    int reuse = 1;
+    setsockopt(listenFd_, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    struct sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (bind(listenFd_, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+        ::listen(listenFd_, 16) != 0 ||
+        !set_nonblocking(listenFd_))
+    {
+        close(listenFd_);
+        listenFd_ = -1;
+        return false;
+    }
+    return true;
+}
+
+uint16_t TunnelLimiter::getLocalPort()
+{
+    struct sockaddr_in addr = {};
+    socklen_t len = sizeof(addr);
+    if (listenFd_ == -1 || getsockname(listenFd_, (struct sockaddr*)&addr, &len) != 0) {
+        return 0;
+    }
+    return ntohs(addr.sin_port);
+}
+
+void TunnelLimiter::rememberListeners()
+{
+    knownListeners_.clear();
+    for (auto& l : process_listeners()) {
+        knownListeners_.insert(l.first);
+    }
+}
+
+bool TunnelLimiter::findTunnelListener()
+{
+    bool found = false;
+    for (auto& l : process_listeners()) {
+        if (knownListeners_.count(l.first) || l.second.fd == listenFd_) {
+            continue;
+        }
+        if (found) {
+            std::cerr << "More than one new tcp listener, cannot tell which one is the tunnel" << std::endl;
+            return false;
+        }
+        found = true;
+        tunnelFd_ = l.second.fd;
+        tunnelFamily_ = l.second.family;
+        tunnelPort_ = l.second.port;
+    }
+    return found;
+}
+
+/**
+ * Only let tcp segments from the loopback address and the source ports
+ * of the limiter's own connections reach the tunnel listener. The ports
+ * alone are not enough as anyone can bind another loopback address,
+ * e.g. 127.0.0.2, to the same port. The limiter's sockets are bound to
+ * the exact address and port so nobody else can use that pair.
+ * Connections accepted by the listener inherit the filter it had when
+ * they were created.
+ */
+bool TunnelLimiter::updateFilter()
+{
+    std::vector<struct sock_filter> filter;
+    // drop the segment unless the field at offset equals value
+    auto expect = [&](uint32_t mode, int32_t offset, uint32_t mask, uint32_t value) {
+        filter.push_back(BPF_STMT(BPF_LD | mode | BPF_ABS, (uint32_t)offset));
+        if (mask) {
+            filter.push_back(BPF_STMT(BPF_ALU | BPF_AND | BPF_K, mask));
+        }
+        filter.push_back(BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, value, 1, 0));
+        filter.push_back(BPF_STMT(BPF_RET | BPF_K, 0));
+    };
+    // The ip header is found through SKF_NET_OFF, its version comes
+    // first as a v4 packet can reach a dual stack v6 listener.
+    if (tunnelFamily_ == AF_INET6) {
+        expect(BPF_B, SKF_NET_OFF, 0xf0, 0x60);
+        expect(BPF_W, SKF_NET_OFF + 8, 0, 0);
+        expect(BPF_W, SKF_NET_OFF + 12, 0, 0);
+        expect(BPF_W, SKF_NET_OFF + 16, 0, 0);
+        expect(BPF_W, SKF_NET_OFF + 20, 0, 1);
+    } else {
+        expect(BPF_B, SKF_NET_OFF, 0xf0, 0x40);
+        expect(BPF_W, SKF_NET_OFF + 12, 0, INADDR_LOOPBACK);
+    }
+    // the tcp header is at offset 0, the source port is its first field
+    filter.push_back(BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 0));
+    for (uint16_t port : allowedPorts_) {
+        filter.push_back(BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, port, 0, 1));
+        filter.push_back(BPF_STMT(BPF_RET | BPF_K, 0xffffffff));
+    }
+    filter.push_back(BPF_STMT(BPF_RET | BPF_K, 0));
+    struct sock_fprog program;
+    program.len = (unsigned short)filter.size();
+    program.filter = filter.data();
+    return setsockopt(tunnelFd_, SOL_SOCKET, SO_ATTACH_FILTER, &program, sizeof(program)) == 0;
+}
+
+bool TunnelLimiter::start()
+{
+    if (!findTunnelListener()) {
+        return false;
+    }
+    if (!updateFilter()) {
+        std::cerr << "Could not attach a socket filter to the tunnel listener" << std::endl;
+        return false;
+    }
+    // The listener was reachable without the filter from when the tunnel
+    // was opened until now. A connection made in that window would not
+    // be limited, so give up rather than run with it.
+    if (has_connections(tunnelPort_)) {
+        std::cerr << "The tunnel listener got a connection before it was restricted to the limiter" << std::endl;
+        return false;
+    }
+    lastRefill_ = std::chrono::steady_clock::now();
+    thread_ = std::make_unique<std::thread>(&TunnelLimiter::run, this);
+    return true;
+}
+
+void TunnelLimiter::stop()
+{
+    stopped_ = true;
+    if (thread_ && thread_->joinable()) {
+        thread_->join();
+    }
+}
+
+void TunnelLimiter::acceptConnection()
+{
+    int client = accept(listenFd_, NULL, NULL);
+    if (client == -1) {
+        return;
+    }
+    if (limits_.maxConnections != 0 && sessions_.size() >= limits_.maxConnections) {
+        std::cout << "Rejecting tcp connection, the tunnel already has " << sessions_.size() << " connections" << std::endl;
+        close(client);
+        return;
+    }
+
+    if (allowedPorts_.size() >= MAX_FILTER_PORTS) {
+        std::cout << "Rejecting tcp connection, the tunnel filter is full" << std::endl;
+        close(client);
+        return;
+    }
+
+    // Bind first such that the filter can allow the source port before
+    // the connection is made.
+    struct sockaddr_storage addr;
+    socklen_t addrLen = loopback_address(tunnelFamily_, 0, addr);
+    int tunnel = socket(tunnelFamily_, SOCK_STREAM, 0);
+    if (tunnel == -1 || bind(tunnel, (struct sockaddr*)&addr, addrLen) != 0 ||
+        getsockname(tunnel, (struct sockaddr*)&addr, &addrLen) != 0 || !set_nonblocking(tunnel))
+    {
+        std::cerr << "Could not create a socket for the tunnel" << std::endl;
+        if (tunnel != -1) {
+            close(tunnel);
+        }
+        close(client);
+        return;
+    }
+    uint16_t sourcePort = ntohs(tunnelFamily_ == AF_INET6 ? ((struct sockaddr_in6*)&addr)->sin6_port : ((struct sockaddr_in*)&addr)->sin_port);
+    allowedPorts_.insert(sourcePort);
+    addrLen = loopback_address(tunnelFamily_, tunnelPort_, addr);
+    if (!updateFilter() || (connect(tunnel, (struct sockaddr*)&addr, addrLen) != 0 && errno != EINPROGRESS)) {
+        std::cerr << "Could not connect to the tunnel listener on port " << tunnelPort_ << std::endl;
+        allowedPorts_.erase(sourcePort);
+        close(tunnel);
+        close(client);
+        return;
+    }
+    int nodelay = 1;
+    setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    setsockopt(tunnel, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    set_nonblocking(client);
+
+    auto s = std::make_unique<Session>();
+    s->client = client;
+    s->tunnel = tunnel;
+    s->tunnelSourcePort = sourcePort;
+    s->up.from = client;
+    s->up.to = tunnel;
+    s->up.buffer.resize(BUFFER_SIZE);
+    s->down.from = tunnel;
+    s->down.to = client;
+    s->down.buffer.resize(BUFFER_SIZE);
+    s->tokens = burst(limits_.connectionRate);
+    sessions_.push_back(std::move(s));
+}
+
+void TunnelLimiter::finishConnect(Session& session)
+{
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(session.tunnel, SOL_SOCKET, SO_ERROR, &err, &len) != 0 || err != 0) {
+        std::cerr << "Could not connect to the tunnel listener on port " << tunnelPort_ << std::endl;
+        session.failed = true;
+        return;
+    }
+    session.connecting = false;
+}
+
+void TunnelLimiter::refill()
+{
+    auto now = std::chrono::steady_clock::now();
+    double elapsed = std::chrono::duration<double>(now - lastRefill_).count();
+    lastRefill_ = now;
+    if (limits_.totalRate) {
+        totalTokens_ = std::min(totalTokens_ + elapsed * limits_.totalRate, burst(limits_.totalRate));
+    }
+    if (limits_.connectionRate) {
+        for (auto& s : sessions_) {
+            s->tokens = std::min(s->tokens + elapsed * limits_.connectionRate, burst(limits_.connectionRate));
+        }
+    }
+}
+
+size_t TunnelLimiter::allowance(Session& session, size_t fairShare)
+{
+    size_t allowed = BUFFER_SIZE;
+    if (limits_.connectionRate) {
+        allowed = std::min(allowed, (size_t)std::max(session.tokens, 0.0));
+    }
+    if (limits_.totalRate) {
+        allowed = std::min(allowed, std::min(fairShare, (size_t)std::max(totalTokens_, 0.0)));
+    }
+    return allowed;
+}
+
+void TunnelLimiter::consume(Session& session, size_t bytes)
+{
+    if (limits_.connectionRate) {
+        session.tokens -= bytes;
+    }
+    if (limits_.totalRate) {
+        totalTokens_ -= bytes;
+    }
+}
+
+void TunnelLimiter::readDirection(Session& session, Direction& d, size_t fairShare)
+{
+    size_t allowed = std::min(allowance(session, fairShare), d.buffer.size() - d.end);
+    if (allowed == 0) {
+        return;
+    }
+    ssize_t n = recv(d.from, d.buffer.data() + d.end, allowed, 0);
+    if (n == 0) {
+        d.eof = true;
+    } else if (n < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            session.failed = true;
+        }
+    } else {
+        d.end += n;
+        consume(session, n);
+    }
+}
+
+void TunnelLimiter::writeDirection(Session& session, Direction& d)
+{
+    if (d.begin < d.end) {
+        ssize_t n = send(d.to, d.buffer.data() + d.begin, d.end - d.begin, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                session.failed = true;
+            }
+            return;
+        }
+        d.begin += n;
+        if (d.begin == d.end) {
+            d.begin = 0;
+            d.end = 0;
+        }
+    }
+    if (d.eof && d.begin == d.end && !d.shutdown) {
+        shutdown(d.to, SHUT_WR);
+        d.shutdown = true;
+    }
+}
+
+bool TunnelLimiter::done(Session& session)
+{
+    return session.failed || (session.up.shutdown && session.down.shutdown);
+}
+
+void TunnelLimiter::closeSession(Session& session)
+{
+    close(session.client);
+    close(session.tunnel);
+    allowedPorts_.erase(session.tunnelSourcePort);
+}
+
+void TunnelLimiter::run()
+{
+    std::vector<struct pollfd> fds;
+    while (!stopped_) {
+        refill();
+
+        fds.clear();
+        fds.push_back({listenFd_, POLLIN, 0});
+
+        bool throttled = false;
+        bool immediate = false;
+        size_t readers = 0;
+        for (auto& s : sessions_) {
+            short clientEvents = 0;
+            short tunnelEvents = 0;
+            if (s->connecting) {
+                tunnelEvents = POLLOUT;
+            } else {
+                for (Direction* d : { &s->up, &s->down }) {
+                    bool fromHup = (d->from == s->client) ? s->clientHup : s->tunnelHup;
+                    short& fromEvents = (d->from == s->client) ? clientEvents : tunnelEvents;
+                    short& toEvents = (d->to == s->client) ? clientEvents : tunnelEvents;
+                    if (d->begin < d->end) {
+                        toEvents |= POLLOUT;
+                    } else if (!d->eof) {
+                        if (allowance(*s, 1) > 0) {
+                            readers++;
+                            // a hung up socket is read until eof
+                            // without waiting for poll
+                            if (fromHup) {
+                                immediate = true;
+                            } else {
+                                fromEvents |= POLLIN;
+                            }
+                        } else {
+                            throttled = true;
+                        }
+                    }
+                }
+            }
+            // Negative fds are ignored by poll. Hung up sockets are left
+            // out as poll reports POLLHUP for them whatever is asked for.
+            fds.push_back({clientEvents && !s->clientHup ? s->client : -1, clientEvents, 0});
+            fds.push_back({tunnelEvents && !s->tunnelHup ? s->tunnel : -1, tunnelEvents, 0});
+        }
+
+        int timeout = immediate ? 0 : (throttled ? THROTTLE_INTERVAL_MS : IDLE_INTERVAL_MS);
+        int ready = poll(fds.data(), fds.size(), timeout);
+        if (ready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            std::cerr << "Tunnel limiter poll failed" << std::endl;
+            return;
+        }
+
+        // Split the aggregate budget evenly between the connections
+        // which want to read in this round.
+        size_t fairShare = BUFFER_SIZE;
+        if (limits_.totalRate && readers > 0) {
+            fairShare = std::max((size_t)(std::max(totalTokens_, 0.0) / readers), (size_t)1);
+        }
+
+        bool closed = false;
+        size_t i = 1;
+        for (auto it = sessions_.begin(); it != sessions_.end(); ) {
+            Session& s = **it;
+            short clientRevents = fds[i].revents;
+            short tunnelRevents = fds[i+1].revents;
+            i += 2;
+            if (s.connecting) {
+                if (tunnelRevents) {
+                    finishConnect(s);
+                }
+            } else if ((clientRevents | tunnelRevents) & (POLLERR | POLLNVAL)) {
+                s.failed = true;
+            } else {
+                // Note hang ups before the throttle is considered, else
+                // a throttled socket would be polled again right away.
+                if (clientRevents & POLLHUP) {
+                    s.clientHup = true;
+                }
+                if (tunnelRevents & POLLHUP) {
+                    s.tunnelHup = true;
+                }
+                for (Direction* d : { &s.up, &s.down }) {
+                    bool fromClient = (d->from == s.client);
+                    short fromRevents = fromClient ? clientRevents : tunnelRevents;
+                    bool fromHup = fromClient ? s.clientHup : s.tunnelHup;
+                    if ((fromRevents & POLLIN) || fromHup) {
+                        readDirection(s, *d, fairShare);
+                    }
+                    writeDirection(s, *d);
+                }
+            }
+            if (done(s)) {
+                closeSession(s);
+                it = sessions_.erase(it);
+                closed = true;
+            } else {
+                ++it;
+            }
+        }
+        if (closed) {
+            updateFilter();
+        }
+
+        // rotate such that another connection is served first next round
+        if (sessions_.size() > 1) {
+            sessions_.splice(sessions_.end(), sessions_, sessions_.begin());
+        }
+
+        if (fds[0].revents & POLLIN) {
+            acceptConnection();
+        }
+    }
+}
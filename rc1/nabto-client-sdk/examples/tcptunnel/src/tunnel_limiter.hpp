@@ -0,0 +1,138 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <set>
+#include <thread>
+#include <vector>
+
+/**
+ * Limits applied to the tcp connections going through one tunnel. A
+ * value of 0 means unlimited.
+ */
+struct TunnelLimits {
+    // max number of concurrent tcp connections
+    size_t maxConnections = 0;
+    // bytes per second for each tcp connection, both directions combined
+    uint64_t connectionRate = 0;
+    // bytes per second for all tcp connections in the tunnel
+    uint64_t totalRate = 0;
+
+    bool enabled() const {
+        return maxConnections != 0 || connectionRate != 0 || totalRate != 0;
+    }
+};
+
+/**
+ * Local tcp front for a nabto tcp tunnel.
+ *
+ * The tcp listener of a tunnel accepts any number of connections and
+ * maps each of them to a stream on the same nabto connection. The
+ * limiter accepts the local connections instead, enforces the
+ * limits and forwards the data to the tunnel listener on the
+ * loopback interface. Connections are served round robin so a few
+ * busy connections cannot starve the others.
+ *
+ * The tunnel listener is created by the client library, so the limiter
+ * finds its socket in /proc and attaches a socket filter to it which
+ * drops connections from anyone but the limiter. This is Linux only
+ * and best effort, see the README.
+ */
+class TunnelLimiter {
+ public:
+    TunnelLimiter(const TunnelLimits& limits);
+    ~TunnelLimiter();
+
+    /**
+     * Bind the local tcp listener. If port is 0 a port is chosen.
+     *
+     * @return false if the listener could not be created.
+     */
+    bool listen(uint16_t port);
+
+    /**
+     * The port the local tcp listener is bound to.
+     */
+    uint16_t getLocalPort();
+
+    /**
+     * Remember the tcp listeners of this process. Call it right before
+     * the tunnel is opened with local port 0, start() then takes the
+     * new listener to be the tunnel listener.
+     */
+    void rememberListeners();
+
+    /**
+     * Find the tunnel listener, restrict it to connections from the
+     * limiter and start forwarding accepted connections to it.
+     *
+     * @return false if the tunnel listener could not be found or
+     * restricted, or if it got a connection before it was restricted.
+     */
+    bool start();
+    void stop();
+
+    /**
+     * The port of the tunnel listener, 0 before start().
+     */
+    uint16_t getTunnelPort() {
+        return tunnelPort_;
+    }
+
+ private:
+    struct Direction {
+        int from;
+        int to;
+        std::vector<uint8_t> buffer;
+        size_t begin = 0;
+        size_t end = 0;
+        bool eof = false;
+        bool shutdown = false;
+    };
+
+    struct Session {
+        int client;
+        int tunnel;
+        // source port of the tunnel socket, allowed by the filter
+        uint16_t tunnelSourcePort;
+        Direction up;
+        Direction down;
+        double tokens;
+        bool connecting = true;
+        // the peer hung up, the socket is read without polling it
+        bool clientHup = false;
+        bool tunnelHup = false;
+        bool failed = false;
+    };
+
+    bool findTunnelListener();
+    bool updateFilter();
+    void run();
+    void acceptConnection();
+    void finishConnect(Session& session);
+    void refill();
+    size_t allowance(Session& session, size_t fairShare);
+    void consume(Session& session, size_t bytes);
+    void readDirection(Session& session, Direction& d, size_t fairShare);
+    void writeDirection(Session& session, Direction& d);
+    bool done(Session& session);
+    void closeSession(Session& session);
+
+    TunnelLimits limits_;
+    int listenFd_ = -1;
+    // inodes of the listeners which existed before the tunnel was opened
+    std::set<unsigned long> knownListeners_;
+    // the tunnel listener, owned by the client library
+    int tunnelFd_ = -1;
+    int tunnelFamily_ = 0;
+    uint16_t tunnelPort_ = 0;
+    std::set<uint16_t> allowedPorts_;
+    std::list<std::unique_ptr<Session> > sessions_;
+    double totalTokens_;
+    std::chrono::steady_clock::time_point lastRefill_;
+    std::atomic<bool> stopped_;
+    std::unique_ptr<std::thread> thread_;
+};
@@ -0,0 +1,272 @@
+/**
+ * Heap allocation statistics per library, loaded with LD_PRELOAD.
+ *
+ * malloc, calloc, realloc, free and the aligned allocation functions
+ * are wrapped and each call is
+ * attributed to the Nabto SDK library which made it, or to the rest
+ * of the process. This makes it possible to see the heap use of
+ * libnabto_device.so and libnabto_client.so separately from the
+ * application without changing the application.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <link.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+namespace {
+
+enum Owner {
+    OWNER_DEVICE_SDK = 0,
+    OWNER_CLIENT_SDK = 1,
+    OWNER_OTHER = 2,
+    OWNER_COUNT = 3
+};
+
+const char* ownerNames[OWNER_COUNT] = { "libnabto_device", "libnabto_client", "other" };
+
+struct Counters {
+    uint64_t allocations;
+    uint64_t frees;
+    uint64_t bytes;
+};
+
+struct Range {
+    uintptr_t begin;
+    uintptr_t end;
+};
+
+Counters counters[OWNER_COUNT];
+// executable segments of the sdk libraries, found once at startup
+Range ranges[OWNER_CLIENT_SDK + 1][4];
+size_t rangeCount[OWNER_CLIENT_SDK + 1];
+
+typedef void* (*MallocFn)(size_t);
+typedef void* (*CallocFn)(size_t, size_t);
+typedef void* (*ReallocFn)(void*, size_t);
+typedef void (*FreeFn)(void*);
+typedef int (*PosixMemalignFn)(void**, size_t, size_t);
+typedef void* (*AlignedAllocFn)(size_t, size_t);
+
+MallocFn realMalloc = NULL;
+CallocFn realCalloc = NULL;
+ReallocFn realRealloc = NULL;
+FreeFn realFree = NULL;
+PosixMemalignFn realPosixMemalign = NULL;
+AlignedAllocFn realAlignedAlloc = NULL;
+AlignedAllocFn realMemalign = NULL;
+
+// dlsym can allocate before the real functions are known, those
+// allocations are served from a static buffer and never freed.
+char bootstrapBuffer[4096];
+size_t bootstrapUsed = 0;
+bool initializing = false;
+
+bool isBootstrap(void* ptr)
+{
+    return (char*)ptr >= bootstrapBuffer && (char*)ptr < bootstrapBuffer + sizeof(bootstrapBuffer);
+}
+
+// alignment must be a power of two
+void* bootstrapAlloc(size_t size, size_t alignment = 16)
+{
+    uintptr_t base = (uintptr_t)bootstrapBuffer;
+    size_t offset = ((base + bootstrapUsed + alignment - 1) & ~(uintptr_t)(alignment - 1)) - base;
+    if (offset > sizeof(bootstrapBuffer) || size > sizeof(bootstrapBuffer) - offset) {
+        return NULL;
+    }
+    bootstrapUsed = offset + size;
+    return bootstrapBuffer + offset;
+}
+
+int findSdkLibraries(struct dl_phdr_info* info, size_t, void*)
+{
+    int owner;
+    if (strstr(info->dlpi_name, "libnabto_device") != NULL) {
+        owner = OWNER_DEVICE_SDK;
+    } else if (strstr(info->dlpi_name, "libnabto_client") != NULL) {
+        owner = OWNER_CLIENT_SDK;
+    } else {
+        return 0;
+    }
+    for (int i = 0; i < info->dlpi_phnum && rangeCount[owner] < 4; i++) {
+        const ElfW(Phdr)& ph = info->dlpi_phdr[i];
+        if (ph.p_type == PT_LOAD && (ph.p_flags & PF_X)) {
+            Range& r = ranges[owner][rangeCount[owner]++];
+            r.begin = info->dlpi_addr + ph.p_vaddr;
+            r.end = r.begin + ph.p_memsz;
+        }
+    }
+    return 0;
+}
+
+void init()
+{
+    if (realMalloc || initializing) {
+        return;
+    }
+    initializing = true;
+    realCalloc = (CallocFn)dlsym(RTLD_NEXT, "calloc");
+    realRealloc = (ReallocFn)dlsym(RTLD_NEXT, "realloc");
+    realFree = (FreeFn)dlsym(RTLD_NEXT, "free");
+    realPosixMemalign = (PosixMemalignFn)dlsym(RTLD_NEXT, "posix_memalign");
+    realAlignedAlloc = (AlignedAllocFn)dlsym(RTLD_NEXT, "aligned_alloc");
+    realMemalign = (AlignedAllocFn)dlsym(RTLD_NEXT, "memalign");
+    realMalloc = (MallocFn)dlsym(RTLD_NEXT, "malloc");
+    dl_iterate_phdr(findSdkLibraries, NULL);
+    initializing = false;
+}
+
+Owner ownerOf(void* caller)
+{
+    uintptr_t addr = (uintptr_t)caller;
+    for (int owner = 0; owner <= OWNER_CLIENT_SDK; owner++) {
+        for (size_t i = 0; i < rangeCount[owner]; i++) {
+            if (addr >= ranges[owner][i].begin && addr < ranges[owner][i].end) {
+                return (Owner)owner;
+            }
+        }
+    }
+    return OWNER_OTHER;
+}
+
+void countAllocation(void* caller, size_t size)
+{
+    Counters& c = counters[ownerOf(caller)];
+    __atomic_add_fetch(&c.allocations, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&c.bytes, size, __ATOMIC_RELAXED);
+}
+
+void countFree(void* caller)
+{
+    __atomic_add_fetch(&counters[ownerOf(caller)].frees, 1, __ATOMIC_RELAXED);
+}
+
+} // namespace
+
+extern "C" {
+
+/**
+ * Print the counters to stderr. Can be called from an application
+ * which links the library directly, e.g. before and after an
+ * operation, to get the allocations of that operation.
+ */
+void nabto_alloc_stats_print()
+{
+    fprintf(stderr, "%-16s %14s %14s %16s\n", "caller", "allocations", "frees", "bytes allocated");
+    for (int i = 0; i < OWNER_COUNT; i++) {
+        fprintf(stderr, "%-16s %14llu %14llu %16llu\n", ownerNames[i],
+                (unsigned long long)__atomic_load_n(&counters[i].allocations, __ATOMIC_RELAXED),
+                (unsigned long long)__atomic_load_n(&counters[i].frees, __ATOMIC_RELAXED),
+                (unsigned long long)__atomic_load_n(&counters[i].bytes, __ATOMIC_RELAXED));
+    }
+}
+
+void* malloc(size_t size)
+{
+    init();
+    if (!realMalloc) {
+        return bootstrapAlloc(size);
+    }
+    countAllocation(__builtin_return_address(0), size);
+    return realMalloc(size);
+}
+
+void* calloc(size_t n, size_t size)
+{
+    init();
+    if (size != 0 && n > SIZE_MAX / size) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    if (!realCalloc) {
+        // the static buffer is zero initialized
+        return bootstrapAlloc(n * size);
+    }
+    countAllocation(__builtin_return_address(0), n * size);
+    return realCalloc(n, size);
+}
+
+void* realloc(void* ptr, size_t size)
+{
+    init();
+    if (isBootstrap(ptr)) {
+        void* copy = malloc(size);
+        size_t available = bootstrapBuffer + sizeof(bootstrapBuffer) - (char*)ptr;
+        if (copy) {
+            memcpy(copy, ptr, size < available ? size : available);
+        }
+        return copy;
+    }
+    void* caller = __builtin_return_address(0);
+    void* result = realRealloc(ptr, size);
+    // realloc(ptr, 0) frees ptr. Moving or resizing a block frees the
+    // old one and allocates a new one, unless it fails.
+    if (ptr != NULL && (size == 0 || result != NULL)) {
+        countFree(caller);
+    }
+    if (size != 0 || ptr == NULL) {
+        countAllocation(caller, size);
+    }
+    return result;
+}
+
+int posix_memalign(void** ptr, size_t alignment, size_t size)
+{
+    init();
+    if (!realPosixMemalign) {
+        *ptr = bootstrapAlloc(size, alignment);
+        return *ptr ? 0 : ENOMEM;
+    }
+    countAllocation(__builtin_return_address(0), size);
+    return realPosixMemalign(ptr, alignment, size);
+}
+
+void* aligned_alloc(size_t alignment, size_t size)
+{
+    init();
+    if (!realAlignedAlloc) {
+        return bootstrapAlloc(size, alignment);
+    }
+    countAllocation(__builtin_return_address(0), size);
+    return realAlignedAlloc(alignment, size);
+}
+
+void* memalign(size_t alignment, size_t size)
+{
+    init();
+    if (!realMemalign) {
+        return bootstrapAlloc(size, alignment);
+    }
+    countAllocation(__builtin_return_address(0), size);
+    return realMemalign(alignment, size);
+}
+
+void free(void* ptr)
+{
+    if (ptr == NULL || isBootstrap(ptr)) {
+        return;
+    }
+    init();
+    countFree(__builtin_return_address(0));
+    realFree(ptr);
+}
+
+} // extern "C"
+
+__attribute__((constructor)) static void alloc_stats_start()
+{
+    init();
+}
+
+__attribute__((destructor)) static void alloc_stats_stop()
+{
+    nabto_alloc_stats_print();
+}
@@ -0,0 +1,181 @@
+#include "cbor_codec.hpp"
+
+#include <nlohmann/json.hpp>
+
+#include <cxxopts.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include <string>
+#include <vector>
+
+using json = nlohmann::json;
+using nabto::common::cbor_field;
+using nabto::common::cbor_enum_entry;
+using nabto::common::cbor_codec_encode;
+using nabto::common::cbor_codec_decode;
+using nabto::common::CborEnumEntry;
+
+// Every heap allocation in the process is counted, so the allocations
+// per operation of each path can be reported.
+static std::atomic<uint64_t> allocations(0);
+
+void* operator new(size_t size)
+{
+    allocations++;
+    void* ptr = malloc(size);
+    if (ptr == NULL) {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+void operator delete(void* ptr) noexcept
+{
+    free(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept
+{
+    free(ptr);
+}
+
+enum class Mode {
+    COOL = 0,
+    HEAT = 1,
+    FAN = 2,
+    DRY = 3
+};
+
+namespace nabto {
+namespace common {
+
+template<>
+struct CborEnum<Mode> {
+    static const CborEnumEntry<Mode>* entries(size_t& count) {
+        static const CborEnumEntry<Mode> e[] = {
+            cbor_enum_entry("COOL", Mode::COOL),
+            cbor_enum_entry("HEAT", Mode::HEAT),
+            cbor_enum_entry("FAN", Mode::FAN),
+            cbor_enum_entry("DRY", Mode::DRY)
+        };
+        count = sizeof(e) / sizeof(e[0]);
+        return e;
+    }
+};
+
+} } // namespace
+
+// Same content as the HeatPump section of the heat pump config.
+struct HeatPumpState {
+    Mode mode;
+    bool power;
+    double target;
+    double temperature;
+
+    static constexpr auto cborFields() {
+        return std::make_tuple(cbor_field("Mode", &HeatPumpState::mode),
+                               cbor_field("Power", &HeatPumpState::power),
+                               cbor_field("Target", &HeatPumpState::target),
+                               cbor_field("Temperature", &HeatPumpState::temperature));
+    }
+};
+
+struct Result {
+    double nanoseconds;
+    double allocations;
+    bool ok;
+};
+
+template<typename F>
+static Result measure(size_t iterations, F f)
+{
+    bool ok = true;
+    uint64_t allocationsStart = allocations.load();
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < iterations; i++) {
+        ok = f() && ok;
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    Result r;
+    r.nanoseconds = (double)std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count() / iterations;
+    r.allocations = (double)(allocations.load() - allocationsStart) / iterations;
+    r.ok = ok;
+    return r;
+}
+
+static json to_json(const Result& r)
+{
+    return { {"nanosecondsPerOp", r.nanoseconds}, {"allocationsPerOp", r.allocations}, {"ok", r.ok} };
+}
+
+// Decode with both paths and encode with both paths, the input is
+// produced by nlohmann so both paths see identical bytes.
+template<typename T>
+static json compare(size_t iterations, const json& value, const T& typed)
+{
+    std::vector<uint8_t> cbor = json::to_cbor(value);
+    uint8_t buffer[256];
+    size_t used;
+
+    json decode;
+    decode["codec"] = to_json(measure(iterations, [&cbor]() {
+                T out;
+                return cbor_codec_decode(cbor.data(), cbor.size(), out) == CborNoError;
+            }));
+    decode["nlohmann"] = to_json(measure(iterations, [&cbor]() {
+                json out = json::from_cbor(cbor);
+                return !out.is_null();
+            }));
+
+    json encode;
+    encode["codec"] = to_json(measure(iterations, [&typed, &buffer, &used]() {
+                return cbor_codec_encode(typed, buffer, sizeof(buffer), &used) == CborNoError;
+            }));
+    encode["nlohmann"] = to_json(measure(iterations, [&value]() {
+                std::vector<uint8_t> out = json::to_cbor(value);
+                return !out.empty();
+            }));
+
+    return { {"payloadBytes", cbor.size()}, {"decode", decode}, {"encode", encode} };
+}
+
+int main(int argc, char** argv)
+{
+    cxxopts::Options options("CBOR bench", "CoAP payload encoding benchmark.");
+    options.add_options()
+        ("h,help", "Shows this help text")
+        ("iterations", "Operations per measurement", cxxopts::value<size_t>()->default_value("1000000"));
+
+    size_t iterations;
+    try {
+        auto result = options.parse(argc, argv);
+        if (result.count("help")) {
+            std::cout << options.help() << std::endl;
+            exit(0);
+        }
+        iterations = result["iterations"].as<size_t>();
+    } catch (...) {
+        std::cout << options.help() << std::endl;
+        exit(1);
+    }
+    if (iterations == 0) {
+        std::cerr << "iterations must be positive" << std::endl;
+        exit(1);
+    }
+
+    HeatPumpState state = { Mode::HEAT, true, 22.5, 21.2 };
+    json stateJson = { {"Mode", "HEAT"}, {"Power", true}, {"Target", 22.5}, {"Temperature", 21.2} };
+
+    json report;
+    report["iterations"] = iterations;
+    report["power"] = compare(iterations, json(true), true);
+    report["target"] = compare(iterations, json(22.5), 22.5);
+    report["mode"] = compare(iterations, json("HEAT"), Mode::HEAT);
+    report["state"] = compare(iterations, stateJson, state);
+    std::cout << report.dump(2) << std::endl;
+    return 0;
+}
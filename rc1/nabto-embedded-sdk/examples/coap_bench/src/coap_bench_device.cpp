@@ -0,0 +1,423 @@
+#include <nabto/nabto_device.h>
+#include <nabto/nabto_device_experimental.h>
+
+#include "json_config.hpp"
+#include "coap_request_handler.hpp"
+#include "executor.hpp"
+
+#include <cxxopts.hpp>
+
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <signal.h>
+#include <stdio.h>
+#include <unistd.h>
+
+const static uint16_t CONTENT_FORMAT_APPLICATION_JSON = 50;
+const static uint16_t CONTENT_FORMAT_APPLICATION_OCTET_STREAM = 42;
+
+// Everybody gets the Bench role, the policy is still evaluated for
+// each request such that the cost of the IAM check is measured.
+const json coapBenchIam = R"(
+{
+  "DefaultRole": "Bench",
+  "Policies": {
+    "Bench": {
+      "Statements": [
+        {
+          "Actions": [
+            "Bench:Get",
+            "Bench:Post"
+          ],
+          "Allow": true
+        }
+      ],
+      "Version": 1
+    }
+  },
+  "Roles": {
+    "Bench": [
+      "Bench"
+    ]
+  },
+  "Users": {
+  }
+}
+)"_json;
+
+/**
+ * Latency histogram with power of two buckets in nanoseconds, bucket
+ * i counts samples in [2^(i-1), 2^i). An IAM check is often well
+ * below a microsecond so microseconds are too coarse.
+ */
+class LatencyHistogram {
+ public:
+    static const size_t BUCKETS = 40;
+
+    void add(uint64_t ns) {
+        size_t bucket = 0;
+        while (bucket < BUCKETS - 1 && ns >= ((uint64_t)1 << bucket)) {
+            bucket++;
+        }
+        buckets_[bucket]++;
+        count_++;
+        sum_ += ns;
+        if (ns > max_) {
+            max_ = ns;
+        }
+    }
+
+    // upper bound of the bucket containing the p'th percentile
+    uint64_t percentile(double p) const {
+        uint64_t rank = (uint64_t)(p * count_);
+        uint64_t seen = 0;
+        for (size_t i = 0; i < BUCKETS; i++) {
+            seen += buckets_[i];
+            if (seen > rank) {
+                return std::min((uint64_t)1 << i, max_);
+            }
+        }
+        return max_;
+    }
+
+    json toJson() const {
+        json j;
+        j["count"] = count_;
+        j["meanNanoseconds"] = count_ ? (double)sum_ / count_ : 0;
+        j["p50"] = percentile(0.50);
+        j["p99"] = percentile(0.99);
+        j["p999"] = percentile(0.999);
+        j["max"] = max_;
+        json buckets = json::array();
+        for (size_t i = 0; i < BUCKETS; i++) {
+            if (buckets_[i]) {
+                buckets.push_back({{"lessThanNanoseconds", (uint64_t)1 << i}, {"count", buckets_[i]}});
+            }
+        }
+        j["histogram"] = buckets;
+        return j;
+    }
+
+ private:
+    uint64_t buckets_[BUCKETS] = {};
+    uint64_t count_ = 0;
+    uint64_t sum_ = 0;
+    uint64_t max_ = 0;
+};
+
+class CoapBench {
+ public:
+    CoapBench(NabtoDevice* device, size_t responseSize, uint64_t handlerWork, size_t workerThreads)
+        : device_(device), response_(responseSize, 'x'), handlerWork_(handlerWork),
+          workerThreads_(workerThreads), workerPool_(workerThreads, 1024)
+    {
+    }
+
+    void init()
+    {
+        const char* getPath[] = { "bench", "get", NULL };
+        const char* postPath[] = { "bench", "post", NULL };
+        const char* statsPath[] = { "bench", "stats", NULL };
+        const char* resetPath[] = { "bench", "reset", NULL };
+        nabto::common::Executor* executor = NULL;
+        if (workerThreads_ > 0) {
+            executor = &workerPool_;
+        }
+        coapGet_ = std::make_unique<nabto::common::CoapRequestHandler>(this, device_, NABTO_DEVICE_COAP_GET, getPath, &CoapBench::handleGet, executor);
+        coapPost_ = std::make_unique<nabto::common::CoapRequestHandler>(this, device_, NABTO_DEVICE_COAP_POST, postPath, &CoapBench::handlePost, executor);
+        coapStats_ = std::make_unique<nabto::common::CoapRequestHandler>(this, device_, NABTO_DEVICE_COAP_GET, statsPath, &CoapBench::handleStats);
+        coapReset_ = std::make_unique<nabto::common::CoapRequestHandler>(this, device_, NABTO_DEVICE_COAP_POST, resetPath, &CoapBench::handleReset);
+    }
+
+    void deinit()
+    {
+        coapGet_->stopListen();
+        coapPost_->stopListen();
+        coapStats_->stopListen();
+        coapReset_->stopListen();
+        workerPool_.stop();
+    }
+
+    static void handleGet(NabtoDeviceCoapRequest* request, void* userData)
+    {
+        CoapBench* bench = (CoapBench*)userData;
+        bench->handle(request, "Bench:Get", true);
+    }
+
+    static void handlePost(NabtoDeviceCoapRequest* request, void* userData)
+    {
+        CoapBench* bench = (CoapBench*)userData;
+        bench->handle(request, "Bench:Post", false);
+    }
+
+    static void handleStats(NabtoDeviceCoapRequest* request, void* userData)
+    {
+        CoapBench* bench = (CoapBench*)userData;
+        json stats;
+        {
+            std::unique_lock<std::mutex> lock(bench->mutex_);
+            stats["iam"] = bench->iam_.toJson();
+            stats["handler"] = bench->handler_.toJson();
+            stats["denied"] = bench->denied_;
+        }
+        std::string payload = stats.dump();
+        nabto_device_coap_response_set_code(request, 205);
+        nabto_device_coap_response_set_content_format(request, CONTENT_FORMAT_APPLICATION_JSON);
+        nabto_device_coap_response_set_payload(request, payload.data(), payload.size());
+        nabto_device_coap_response_ready(request);
+        nabto_device_coap_request_free(request);
+    }
+
+    static void handleReset(NabtoDeviceCoapRequest* request, void* userData)
+    {
+        CoapBench* bench = (CoapBench*)userData;
+        {
+            std::unique_lock<std::mutex> lock(bench->mutex_);
+            bench->iam_ = LatencyHistogram();
+            bench->handler_ = LatencyHistogram();
+            bench->denied_ = 0;
+        }
+        nabto_device_coap_response_set_code(request, 204);
+        nabto_device_coap_response_ready(request);
+        nabto_device_coap_request_free(request);
+    }
+
+ private:
+    void handle(NabtoDeviceCoapRequest* request, const char* action, bool sendPayload)
+    {
+        auto start = std::chrono::steady_clock::now();
+        NabtoDeviceError effect = nabto_device_iam_check_action(device_, nabto_device_coap_request_get_connection_ref(request), action);
+        auto checked = std::chrono::steady_clock::now();
+
+        if (effect != NABTO_DEVICE_EC_OK) {
+            nabto_device_coap_error_response(request, 403, "Unauthorized");
+            nabto_device_coap_request_free(request);
+            std::unique_lock<std::mutex> lock(mutex_);
+            iam_.add(std::chrono::duration_cast<std::chrono::nanoseconds>(checked - start).count());
+            denied_++;
+            return;
+        }
+
+        // synthetic application work
+        while (std::chrono::steady_clock::now() - checked < std::chrono::microseconds(handlerWork_)) {
+        }
+
+        if (sendPayload) {
+            nabto_device_coap_response_set_code(request, 205);
+            nabto_device_coap_response_set_content_format(request, CONTENT_FORMAT_APPLICATION_OCTET_STREAM);
+            nabto_device_coap_response_set_payload(request, response_.data(), response_.size());
+        } else {
+            nabto_device_coap_response_set_code(request, 204);
+        }
+        nabto_device_coap_response_ready(request);
+        nabto_device_coap_request_free(request);
+        auto done = std::chrono::steady_clock::now();
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        iam_.add(std::chrono::duration_cast<std::chrono::nanoseconds>(checked - start).count());
+        handler_.add(std::chrono::duration_cast<std::chrono::nanoseconds>(done - checked).count());
+    }
+
+    NabtoDevice* device_;
+    std::vector<uint8_t> response_;
+    uint64_t handlerWork_;
+    size_t workerThreads_;
+    nabto::common::WorkerPool workerPool_;
+
+    std::mutex mutex_;
+    LatencyHistogram iam_;
+    LatencyHistogram handler_;
+    uint64_t denied_ = 0;
+
+    std::unique_ptr<nabto::common::CoapRequestHandler> coapGet_;
+    std::unique_ptr<nabto::common::CoapRequestHandler> coapPost_;
+    std::unique_ptr<nabto::common::CoapRequestHandler> coapStats_;
+    std::unique_ptr<nabto::common::CoapRequestHandler> coapReset_;
+};
+
+static bool init_coap_bench(const std::string& configFile, const std::string& productId, const std::string& deviceId, const std::string& server);
+static void run_coap_bench(const std::string& configFile, const std::string& logLevel, uint16_t localPort, size_t responseSize, uint64_t handlerWork, size_t workerThreads);
+
+void signalHandler(int s)
+{
+    printf("Caught signal %d\n", s);
+}
+
+int main(int argc, char** argv)
+{
+    cxxopts::Options options("CoAP bench", "Nabto CoAP benchmark device, serves synthetic CoAP resources for coap_bench_client.");
+
+    options.add_options("General")
+        ("h,help", "Show help")
+        ("i,init", "Write configuration to the config file and create a a private key")
+        ("c,config", "Config file to write to", cxxopts::value<std::string>()->default_value("coap_bench_device.json"))
+        ("log-level", "Log level to log (error|info|trace|debug)", cxxopts::value<std::string>()->default_value("error"))
+        ("local-port", "Local udp port for direct connections, 0 is ephemeral", cxxopts::value<uint16_t>()->default_value("0"));
+
+    options.add_options("Handlers")
+        ("response-size", "Size of the GET /bench/get response payload", cxxopts::value<size_t>()->default_value("64"))
+        ("handler-work", "Microseconds of synthetic work in each handler", cxxopts::value<uint64_t>()->default_value("0"))
+        ("worker-threads", "Run the handlers on this many worker threads, 0 runs them on the core thread", cxxopts::value<size_t>()->default_value("0"));
+
+    options.add_options("Init Parameters")
+        ("p,product", "Product id", cxxopts::value<std::string>())
+        ("d,device", "Device id", cxxopts::value<std::string>())
+        ("s,server", "hostname of the server", cxxopts::value<std::string>());
+    try {
+        auto result = options.parse(argc, argv);
+
+        if (result.count("help"))
+        {
+            std::cout << options.help({"General", "Handlers", "Init Parameters"}) << std::endl;
+            exit(0);
+        }
+
+        std::string configFile = result["config"].as<std::string>();
+        if (result.count("init") > 0) {
+            std::string productId = result["product"].as<std::string>();
+            std::string deviceId = result["device"].as<std::string>();
+            std::string server = result["server"].as<std::string>();
+            if (!init_coap_bench(configFile, productId, deviceId, server)) {
+                std::cerr << "Initialization failed" << std::endl;
+            }
+        } else {
+            run_coap_bench(configFile,
+                           result["log-level"].as<std::string>(),
+                           result["local-port"].as<uint16_t>(),
+                           result["response-size"].as<size_t>(),
+                           result["handler-work"].as<uint64_t>(),
+                           result["worker-threads"].as<size_t>());
+        }
+    } catch (const cxxopts::OptionException& e) {
+        std::cout << "Error parsing options: " << e.what() << std::endl;
+        std::cout << options.help({"General", "Handlers", "Init Parameters"}) << std::endl;
+        exit(-1);
+    } catch (const std::domain_error& e) {
+        std::cout << "Error parsing options: " << e.what() << std::endl;
+        std::cout << options.help({"General", "Handlers", "Init Parameters"}) << std::endl;
+        exit(-1);
+    }
+    return 0;
+}
+
+bool init_coap_bench(const std::string& configFile, const std::string& productId, const std::string& deviceId, const std::string& server)
+{
+    if (json_config_exists(configFile)) {
+        std::cerr << "The config already file exists, remove " << configFile << " and try again" << std::endl;
+        exit(2);
+    }
+
+    json config;
+
+    NabtoDevice* device = nabto_device_new();
+    NabtoDeviceError ec;
+
+    char* str;
+    ec = nabto_device_create_private_key(device, &str);
+    if (ec) {
+        std::cerr << "Error creating private key" << std::endl;
+        return false;
+    }
+    std::string privateKey(str);
+    nabto_device_string_free(str);
+
+    config["PrivateKey"] = privateKey;
+    config["ProductId"] = productId;
+    config["DeviceId"] = deviceId;
+    config["Server"] = server;
+
+    json_config_save(configFile, config);
+
+    nabto_device_stop(device);
+    nabto_device_free(device);
+    return true;
+}
+
+void run_coap_bench(const std::string& configFile, const std::string& logLevel, uint16_t localPort, size_t responseSize, uint64_t handlerWork, size_t workerThreads)
+{
+    NabtoDeviceError ec;
+    json config;
+    if (!json_config_load(configFile, config)) {
+        std::cerr << "The config file " << configFile << " does not exists, run with --init to create the config file" << std::endl;
+        exit(-1);
+    }
+
+    NabtoDevice* device = nabto_device_new();
+
+    auto productId = config["ProductId"].get<std::string>();
+    auto deviceId  = config["DeviceId"].get<std::string>();
+    auto server = config["Server"].get<std::string>();
+    auto privateKey = config["PrivateKey"].get<std::string>();
+
+    ec = nabto_device_set_product_id(device, productId.c_str());
+    if (ec) {
+        std::cerr << "Could not set product id" << std::endl;
+    }
+    ec = nabto_device_set_device_id(device, deviceId.c_str());
+    if (ec) {
+        std::cerr << "Could not set device id" << std::endl;
+    }
+    ec = nabto_device_set_server_url(device, server.c_str());
+    if (ec) {
+        std::cerr << "Could not set server url" << std::endl;
+    }
+    ec = nabto_device_set_private_key(device, privateKey.c_str());
+    if (ec) {
+        std::cerr << "Could not set private key" << std::endl;
+    }
+    ec = nabto_device_set_local_port(device, localPort);
+    if (ec) {
+        std::cerr << "Could not set local port" << std::endl;
+    }
+    std::vector<uint8_t> iamCbor = json::to_cbor(coapBenchIam);
+    ec = nabto_device_iam_load(device, iamCbor.data(), iamCbor.size());
+    if (ec) {
+        std::cerr << "failed to load iam" << std::endl;
+    }
+    ec = nabto_device_set_log_level(device, logLevel.c_str());
+    if (ec) {
+        std::cerr << "Failed to set loglevel" << std::endl;
+    }
+    ec = nabto_device_set_log_std_out_callback(device);
+    if (ec) {
+        std::cerr << "Failed to enable stdout logging" << std::endl;
+    }
+
+    ec = nabto_device_start(device);
+    if (ec != NABTO_DEVICE_EC_OK) {
+        std::cerr << "Failed to start device" << std::endl;
+        nabto_device_free(device);
+        return;
+    }
+
+    ec = nabto_device_get_local_port(device, &localPort);
+    if (ec == NABTO_DEVICE_EC_OK) {
+        std::cout << "Device " << productId << "." << deviceId << " accepting direct connections on local port " << localPort << std::endl;
+    }
+
+    {
+        CoapBench bench(device, responseSize, handlerWork, workerThreads);
+        bench.init();
+
+        // Wait for the user to press Ctrl-C
+        struct sigaction sigIntHandler;
+        sigIntHandler.sa_handler = signalHandler;
+        sigemptyset(&sigIntHandler.sa_mask);
+        sigIntHandler.sa_flags = 0;
+        sigaction(SIGINT, &sigIntHandler, NULL);
+
+        pause();
+
+        bench.deinit();
+        NabtoDeviceFuture* fut = nabto_device_future_new(device);
+        nabto_device_close(device, fut);
+        nabto_device_future_wait(fut);
+        nabto_device_future_free(fut);
+        nabto_device_stop(device);
+    }
+    nabto_device_free(device);
+}
@@ -0,0 +1,493 @@
+#pragma once
+
+#include <cbor.h>
+#include <cbor_extra.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+namespace nabto {
+namespace common {
+
+/**
+ * Schema driven CBOR encoding and decoding of C++ types on top of
+ * tinycbor. Nothing is allocated on the heap, text is decoded into
+ * fixed size char arrays or enums.
+ *
+ * Supported types are bool, integers, float, double, char[N], enums with
+ * a CborEnum specialization and structs with a static cborFields()
+ * function returning a tuple of cbor_field descriptors. Structs are
+ * encoded as maps, all fields are required when decoding and unknown
+ * keys are skipped.
+ *
+ *   struct State {
+ *       bool power;
+ *       double target;
+ *       static constexpr auto cborFields() {
+ *           return std::make_tuple(cbor_field("Power", &State::power),
+ *                                  cbor_field("Target", &State::target));
+ *       }
+ *   };
+ *
+ *   uint8_t buffer[64];
+ *   size_t used;
+ *   CborError err = cbor_codec_encode(state, buffer, sizeof(buffer), &used);
+ *   err = cbor_codec_decode(buffer, used, state);
+ */
+
+// Longest map key or enum name which can be decoded.
+#define CBOR_CODEC_MAX_NAME_LENGTH 31
+
+template<typename C, typename M>
+struct CborField {
+    const char* name;
+    size_t length;
+    M C::* member;
+};
+
+template<typename C, typename M, size_t N>
+constexpr CborField<C, M> cbor_field(const char (&name)[N], M C::* member)
+{
+    return CborField<C, M>{ name, N - 1, member };
+}
+
+template<typename E>
+struct CborEnumEntry {
+    const char* name;
+    size_t length;
+    E value;
+};
+
+template<typename E, size_t N>
+constexpr CborEnumEntry<E> cbor_enum_entry(const char (&name)[N], E value)
+{
+    return CborEnumEntry<E>{ name, N - 1, value };
+}
+
+/**
+ * Specialize for each enum which is encoded as text, at most 32 names,
+ * e.g.
+ *
+ *   template<>
+ *   struct CborEnum<Mode> {
+ *       static const CborEnumEntry<Mode>* entries(size_t& count) {
+ *           static const CborEnumEntry<Mode> e[] = {
+ *               cbor_enum_entry("COOL", Mode::COOL),
+ *               cbor_enum_entry("HEAT", Mode::HEAT) };
+ *           count = sizeof(e) / sizeof(e[0]);
+ *           return e;
+ *       }
+ *   };
+ */
+template<typename E>
+struct CborEnum;
+
+namespace detail {
+
+inline uint32_t name_hash(const char* name, size_t length, uint32_t seed)
+{
+    // FNV-1a, finished with the murmur3 mixer such that the seed
+    // changes the low bits used for the slot.
+    uint32_t h = 2166136261u ^ seed;
+    for (size_t i = 0; i < length; i++) {
+        h = (h ^ (uint8_t)name[i]) * 16777619u;
+    }
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+}
+
+/**
+ * Perfect hash of the names of an enum. A seed which maps every name to
+ * its own slot is searched once, after that a lookup is one hash and
+ * one compare.
+ */
+template<typename E>
+class CborEnumIndex {
+ public:
+    static const size_t SLOTS = 64;
+    static const uint8_t EMPTY = 0xff;
+    // With 32 names in 64 slots one seed in about 13000 is perfect, so
+    // running out of seeds means duplicate names.
+    static const uint32_t MAX_SEEDS = 1u << 20;
+
+    static const CborEnumIndex& get()
+    {
+        static const CborEnumIndex index;
+        return index;
+    }
+
+    const CborEnumEntry<E>* find(const char* name, size_t length) const
+    {
+        uint8_t slot = slots_[name_hash(name, length, seed_) & mask_];
+        if (slot == EMPTY) {
+            return NULL;
+        }
+        const CborEnumEntry<E>& entry = entries_[slot];
+        if (entry.length != length || memcmp(entry.name, name, length) != 0) {
+            return NULL;
+        }
+        return &entry;
+    }
+
+ private:
+    CborEnumIndex()
+    {
+        size_t count;
+        entries_ = CborEnum<E>::entries(count);
+        if (count > SLOTS / 2) {
+            fail("more than 32 names");
+        }
+        // the table is at least twice the number of names so a seed is
+        // found after a few tries.
+        size_t size = 4;
+        while (size < 2 * count && size < SLOTS) {
+            size *= 2;
+        }
+        mask_ = (uint32_t)(size - 1);
+        for (seed_ = 0; seed_ < MAX_SEEDS; seed_++) {
+            memset(slots_, EMPTY, sizeof(slots_));
+            bool collision = false;
+            for (size_t i = 0; i < count && !collision; i++) {
+                uint32_t h = name_hash(entries_[i].name, entries_[i].length, seed_) & mask_;
+                collision = (slots_[h] != EMPTY);
+                slots_[h] = (uint8_t)i;
+            }
+            if (!collision) {
+                return;
+            }
+        }
+        fail("no perfect hash of the names, are they unique?");
+    }
+
+    // The names are fixed at compile time, so this is a programming
+    // error like the field count check on structs.
+    static void fail(const char* reason)
+    {
+        fprintf(stderr, "CborEnum: %s\n", reason);
+        abort();
+    }
+
+    const CborEnumEntry<E>* entries_;
+    uint8_t slots_[SLOTS];
+    uint32_t mask_;
+    uint32_t seed_;
+};
+
+} // namespace detail
+
+/**
+ * Decode a text string of at most CBOR_CODEC_MAX_NAME_LENGTH into
+ * buffer and advance the value. Longer strings are skipped and length
+ * is set to a value larger than the maximum so they match nothing.
+ */
+inline CborError cbor_codec_decode_name(CborValue* it, char* buffer, size_t& length)
+{
+    if (!cbor_value_is_text_string(it)) {
+        return CborErrorIllegalType;
+    }
+    size_t stringLength;
+    if (cbor_value_get_string_length(it, &stringLength) != CborNoError ||
+        stringLength > CBOR_CODEC_MAX_NAME_LENGTH)
+    {
+        length = CBOR_CODEC_MAX_NAME_LENGTH + 1;
+        return cbor_value_advance(it);
+    }
+    length = CBOR_CODEC_MAX_NAME_LENGTH + 1;
+    return cbor_value_copy_text_string(it, buffer, &length, it);
+}
+
+// Structs with a cborFields() descriptor.
+template<typename T, typename Enable = void>
+struct CborCodec {
+    static CborError encode(CborEncoder* encoder, const T& value);
+    static CborError decode(CborValue* it, T& value);
+};
+
+template<>
+struct CborCodec<bool> {
+    static CborError encode(CborEncoder* encoder, const bool& value)
+    {
+        return cbor_encode_boolean(encoder, value);
+    }
+    static CborError decode(CborValue* it, bool& value)
+    {
+        if (!cbor_value_is_boolean(it)) {
+            return CborErrorIllegalType;
+        }
+        CborError err = cbor_value_get_boolean(it, &value);
+        if (err) {
+            return err;
+        }
+        return cbor_value_advance_fixed(it);
+    }
+};
+
+template<typename T>
+struct CborCodec<T, typename std::enable_if<std::is_integral<T>::value && !std::is_same<T, bool>::value>::type> {
+    static CborError encode(CborEncoder* encoder, const T& value)
+    {
+        if (std::is_signed<T>::value) {
+            return cbor_encode_int(encoder, (int64_t)value);
+        }
+        return cbor_encode_uint(encoder, (uint64_t)value);
+    }
+    static CborError decode(CborValue* it, T& value)
+    {
+        if (!cbor_value_is_integer(it)) {
+            return CborErrorIllegalType;
+        }
+        CborError err;
+        if (std::is_signed<T>::value) {
+            int64_t v;
+            err = cbor_value_get_int64_checked(it, &v);
+            if (err) {
+                return err;
+            }
+            if (v < (int64_t)std::numeric_limits<T>::min() || v > (int64_t)std::numeric_limits<T>::max()) {
+                return CborErrorDataTooLarge;
+            }
+            value = (T)v;
+        } else {
+            uint64_t v;
+            if (!cbor_value_is_unsigned_integer(it)) {
+                return CborErrorImproperValue;
+            }
+            err = cbor_value_get_uint64(it, &v);
+            if (err) {
+                return err;
+            }
+            if (v > (uint64_t)std::numeric_limits<T>::max()) {
+                return CborErrorDataTooLarge;
+            }
+            value = (T)v;
+        }
+        return cbor_value_advance_fixed(it);
+    }
+};
+
+// Integers are accepted when decoding floating point values, clients
+// written in json based languages often send 22 instead of 22.0.
+template<typename T>
+struct CborCodec<T, typename std::enable_if<std::is_floating_point<T>::value>::type> {
+    static CborError encode(CborEncoder* encoder, const T& value)
+    {
+        return cbor_encode_double(encoder, (double)value);
+    }
+    static CborError decode(CborValue* it, T& value)
+    {
+        CborError err;
+        if (cbor_value_is_floating_point(it)) {
+            double v;
+            err = cbor_value_get_floating_point(it, &v);
+            value = (T)v;
+        } else if (cbor_value_is_integer(it)) {
+            int64_t v;
+            err = cbor_value_get_int64_checked(it, &v);
+            value = (T)v;
+        } else {
+            return CborErrorIllegalType;
+        }
+        if (err) {
+            return err;
+        }
+        return cbor_value_advance_fixed(it);
+    }
+};
+
+template<size_t N>
+struct CborCodec<char[N]> {
+    static CborError encode(CborEncoder* encoder, const char (&value)[N])
+    {
+        return cbor_encode_text_string(encoder, value, strnlen(value, N));
+    }
+    static CborError decode(CborValue* it, char (&value)[N])
+    {
+        if (!cbor_value_is_text_string(it)) {
+            return CborErrorIllegalType;
+        }
+        size_t length = N;
+        return cbor_value_copy_text_string(it, value, &length, it);
+    }
+};
+
+template<typename E>
+struct CborCodec<E, typename std::enable_if<std::is_enum<E>::value>::type> {
+    static CborError encode(CborEncoder* encoder, const E& value)
+    {
+        size_t count;
+        const CborEnumEntry<E>* entries = CborEnum<E>::entries(count);
+        for (size_t i = 0; i < count; i++) {
+            if (entries[i].value == value) {
+                return cbor_encode_text_string(encoder, entries[i].name, entries[i].length);
+            }
+        }
+        return CborErrorImproperValue;
+    }
+    static CborError decode(CborValue* it, E& value)
+    {
+        char name[CBOR_CODEC_MAX_NAME_LENGTH + 1];
+        size_t length;
+        CborError err = cbor_codec_decode_name(it, name, length);
+        if (err) {
+            return err;
+        }
+        const CborEnumEntry<E>* entry = detail::CborEnumIndex<E>::get().find(name, length);
+        if (entry == NULL) {
+            return CborErrorImproperValue;
+        }
+        value = entry->value;
+        return CborNoError;
+    }
+};
+
+namespace detail {
+
+template<typename T, typename C, typename M>
+CborError encode_field(CborEncoder* map, const T& value, const CborField<C, M>& field)
+{
+    CborError err = cbor_encode_text_string(map, field.name, field.length);
+    if (err) {
+        return err;
+    }
+    return CborCodec<M>::encode(map, value.*(field.member));
+}
+
+template<typename T, typename Fields, size_t... I>
+CborError encode_fields(CborEncoder* map, const T& value, const Fields& fields, std::index_sequence<I...>)
+{
+    CborError err = CborNoError;
+    int unused[] = { 0, (err = (err != CborNoError) ? err : encode_field(map, value, std::get<I>(fields)), 0)... };
+    (void)unused;
+    return err;
+}
+
+template<typename T, typename C, typename M>
+bool decode_field(CborValue* it, T& value, const CborField<C, M>& field, const char* name, size_t length, CborError& err)
+{
+    if (field.length != length || memcmp(field.name, name, length) != 0) {
+        return false;
+    }
+    err = CborCodec<M>::decode(it, value.*(field.member));
+    return true;
+}
+
+// Decode the value of the map key name into the matching field, returns
+// the index of the field or the number of fields if the key is unknown.
+template<typename T, typename Fields, size_t... I>
+size_t decode_fields(CborValue* it, T& value, const Fields& fields, const char* name, size_t length, CborError& err, std::index_sequence<I...>)
+{
+    size_t index = sizeof...(I);
+    size_t i = 0;
+    int unused[] = { 0, ((index == sizeof...(I) && decode_field(it, value, std::get<I>(fields), name, length, err)) ? (index = i, i++, 0) : (i++, 0))... };
+    (void)unused;
+    return index;
+}
+
+} // namespace detail
+
+template<typename T, typename Enable>
+CborError CborCodec<T, Enable>::encode(CborEncoder* encoder, const T& value)
+{
+    auto fields = T::cborFields();
+    constexpr size_t count = std::tuple_size<decltype(fields)>::value;
+    CborEncoder map;
+    CborError err = cbor_encoder_create_map(encoder, &map, count);
+    if (err) {
+        return err;
+    }
+    err = detail::encode_fields(&map, value, fields, std::make_index_sequence<count>());
+    if (err) {
+        return err;
+    }
+    return cbor_encoder_close_container(encoder, &map);
+}
+
+template<typename T, typename Enable>
+CborError CborCodec<T, Enable>::decode(CborValue* it, T& value)
+{
+    auto fields = T::cborFields();
+    constexpr size_t count = std::tuple_size<decltype(fields)>::value;
+    static_assert(count <= 64, "at most 64 fields are supported");
+    if (!cbor_value_is_map(it)) {
+        return CborErrorIllegalType;
+    }
+    CborValue map;
+    CborError err = cbor_value_enter_container(it, &map);
+    if (err) {
+        return err;
+    }
+    uint64_t seen = 0;
+    while (!cbor_value_at_end(&map)) {
+        char name[CBOR_CODEC_MAX_NAME_LENGTH + 1];
+        size_t length;
+        err = cbor_codec_decode_name(&map, name, length);
+        if (err) {
+            return err;
+        }
+        size_t index = detail::decode_fields(&map, value, fields, name, length, err, std::make_index_sequence<count>());
+        if (index == count) {
+            err = cbor_value_advance(&map);
+        } else {
+            seen |= ((uint64_t)1 << index);
+        }
+        if (err) {
+            return err;
+        }
+    }
+    uint64_t all = (count == 64) ? ~(uint64_t)0 : (((uint64_t)1 << count) - 1);
+    if (seen != all) {
+        return CborErrorTooFewItems;
+    }
+    return cbor_value_leave_container(it, &map);
+}
+
+/**
+ * Encode value into buffer. Returns CborErrorOutOfMemory if the buffer
+ * is too small.
+ */
+template<typename T>
+CborError cbor_codec_encode(const T& value, uint8_t* buffer, size_t size, size_t* used)
+{
+    CborEncoder encoder;
+    cbor_encoder_init(&encoder, buffer, size, 0);
+    CborError err = CborCodec<T>::encode(&encoder, value);
+    if (err) {
+        return err;
+    }
+    *used = cbor_encoder_get_buffer_size(&encoder, buffer);
+    return CborNoError;
+}
+
+/**
+ * Decode exactly one item of type T from the buffer.
+ */
+template<typename T>
+CborError cbor_codec_decode(const uint8_t* buffer, size_t size, T& value)
+{
+    CborParser parser;
+    CborValue it;
+    CborError err = cbor_parser_init(buffer, size, 0, &parser, &it);
+    if (err) {
+        return err;
+    }
+    err = CborCodec<T>::decode(&it, value);
+    if (err) {
+        return err;
+    }
+    if (cbor_value_get_next_byte(&it) != buffer + size) {
+        return CborErrorGarbageAtEnd;
+    }
+    return CborNoError;
+}
+
+} } // namespace
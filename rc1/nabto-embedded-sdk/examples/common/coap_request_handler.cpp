@@ -4,7 +4,12 @@ namespace nabto {
 namespace common {
 
 CoapRequestHandler::CoapRequestHandler(void* application, NabtoDevice* device, NabtoDeviceCoapMethod method, const char** pathSegments, CoapHandler handler)
-    : application_(application), handler_(handler)
+    : CoapRequestHandler(application, device, method, pathSegments, handler, NULL)
+{
+}
+
+CoapRequestHandler::CoapRequestHandler(void* application, NabtoDevice* device, NabtoDeviceCoapMethod method, const char** pathSegments, CoapHandler handler, Executor* executor)
+    : application_(application), handler_(handler), executor_(executor)
 {
     listener_ = nabto_device_listener_new(device);
     future_ = nabto_device_future_new(device);
@@ -27,4 +32,25 @@ void CoapRequestHandler::startListen()
     nabto_device_future_set_callback(future_, CoapRequestHandler::requestCallback, this);
 }
 
+void CoapRequestHandler::dispatch(NabtoDeviceCoapRequest* request, NabtoDeviceConnectionRef ref)
+{
+    // request_ is reused by the next listen so capture the request by value.
+    CoapHandler handler = handler_;
+    void* application = application_;
+    ConnectionQuota* quota = quota_;
+    if (!executor_->post([handler, request, application, quota, ref](){
+                handler(request, application);
+                if (quota) {
+                    quota->release(ref);
+                }
+            }))
+    {
+        nabto_device_coap_error_response(request, 503, "Service Unavailable");
+        nabto_device_coap_request_free(request);
+        if (quota) {
+            quota->release(ref);
+        }
+    }
+}
+
 } } // namespace
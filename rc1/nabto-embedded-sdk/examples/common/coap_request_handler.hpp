@@ -1,5 +1,8 @@
 #pragma once
 
+#include "executor.hpp"
+#include "connection_quota.hpp"
+
 #include <functional>
 #include <nabto/nabto_device.h>
 
@@ -16,6 +19,23 @@ class CoapRequestHandler {
     }
     CoapRequestHandler(void* application, NabtoDevice* device, NabtoDeviceCoapMethod methdod, const char** pathSegments, CoapHandler handler);
 
+    /**
+     * Same as above, but the handler is invoked on the executor instead
+     * of on the Nabto core thread. Use this for handlers which can block.
+     */
+    CoapRequestHandler(void* application, NabtoDevice* device, NabtoDeviceCoapMethod methdod, const char** pathSegments, CoapHandler handler, Executor* executor);
+
+    /**
+     * Limit the number of requests each connection can have in the
+     * handler at the same time. Requests over the limit are answered
+     * with 503 without invoking the handler. The quota can be shared
+     * between handlers.
+     */
+    void setQuota(ConnectionQuota* quota)
+    {
+        quota_ = quota;
+    }
+
     void startListen();
     void stopListen()
     {
@@ -28,10 +48,24 @@ class CoapRequestHandler {
         if (ec != NABTO_DEVICE_EC_OK) {
             return;
         }
-        handler->handler_(handler->request_, handler->application_);
+        NabtoDeviceCoapRequest* request = handler->request_;
+        NabtoDeviceConnectionRef ref = nabto_device_coap_request_get_connection_ref(request);
+        if (handler->quota_ && !handler->quota_->acquire(ref)) {
+            nabto_device_coap_error_response(request, 503, "Service Unavailable");
+            nabto_device_coap_request_free(request);
+        } else if (handler->executor_) {
+            handler->dispatch(request, ref);
+        } else {
+            handler->handler_(request, handler->application_);
+            if (handler->quota_) {
+                handler->quota_->release(ref);
+            }
+        }
         handler->startListen();
     }
 
+    void dispatch(NabtoDeviceCoapRequest* request, NabtoDeviceConnectionRef ref);
+
     void* application_;
     //  wait for a request
     NabtoDeviceFuture* future_;
@@ -40,6 +74,10 @@ class CoapRequestHandler {
     NabtoDeviceListener* listener_;
     // invoke this function if the resource is hit
     CoapHandler handler_;
+    // if set the handler is run on this executor
+    Executor* executor_ = NULL;
+    // if set requests are admitted through this quota
+    ConnectionQuota* quota_ = NULL;
 };
 
 } } // namespace
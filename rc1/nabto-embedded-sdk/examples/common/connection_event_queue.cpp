@@ -0,0 +1,178 @@
+#include "connection_event_queue.hpp"
+
+#include <iostream>
+
+namespace nabto {
+namespace common {
+
+ConnectionEventQueue::ConnectionEventQueue(NabtoDevice* device, size_t capacity, ConnectionEventHandler handler)
+    : handler_(handler), capacity_(capacity)
+{
+    pending_.reserve(capacity_);
+    draining_.reserve(capacity_);
+    batch_.events.reserve(capacity_);
+    drainThread_ = std::thread(&ConnectionEventQueue::runDrain, this);
+
+    listener_ = nabto_device_listener_new(device);
+    future_ = nabto_device_future_new(device);
+    if (!future_) {
+        return;
+    }
+    if (!listener_) {
+        return;
+    }
+    NabtoDeviceError ec = nabto_device_connection_events_init_listener(device, listener_);
+    if (ec) {
+        std::cerr << "Failed to init connection events listener" << std::endl;
+        return;
+    }
+    startListen();
+}
+
+void ConnectionEventQueue::stop()
+{
+    if (listener_) {
+        nabto_device_listener_stop(listener_);
+    }
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        stopped_ = true;
+        drainCv_.notify_one();
+    }
+    if (drainThread_.joinable()) {
+        drainThread_.join();
+    }
+}
+
+void ConnectionEventQueue::startListen()
+{
+    nabto_device_listener_connection_event(listener_, future_, &event_.ref, &event_.event);
+    nabto_device_future_set_callback(future_, &ConnectionEventQueue::eventCallback, this);
+}
+
+void ConnectionEventQueue::eventCallback(NabtoDeviceFuture* fut, NabtoDeviceError ec, void* data)
+{
+    ConnectionEventQueue* queue = (ConnectionEventQueue*)data;
+    if (ec != NABTO_DEVICE_EC_OK) {
+        std::cout << "Connection event called back with error: " << ec << std::endl;
+        return;
+    }
+    queue->push(queue->event_);
+    queue->startListen();
+}
+
+void ConnectionEventQueue::push(const ConnectionEvent& event)
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    enqueue(event);
+    drainCv_.notify_one();
+}
+
+void ConnectionEventQueue::enqueue(const ConnectionEvent& event)
+{
+    received_++;
+    auto it = lastPending_.find(event.ref);
+    if (it != lastPending_.end()) {
+        PendingEvent& last = pending_[it->second];
+        NabtoDeviceConnectionEvent previous = last.event.event;
+        if (event.event == NABTO_DEVICE_CONNECTION_EVENT_CHANNEL_CHANGED &&
+            (previous == NABTO_DEVICE_CONNECTION_EVENT_CHANNEL_CHANGED || previous == NABTO_DEVICE_CONNECTION_EVENT_OPENED))
+        {
+            batchCoalesced_++;
+            coalesced_++;
+            return;
+        }
+        if (event.event == NABTO_DEVICE_CONNECTION_EVENT_CLOSED && previous == NABTO_DEVICE_CONNECTION_EVENT_OPENED) {
+            // the handler never saw the connection, it does not need to
+            // see it close either.
+            last.removed = true;
+            removed_++;
+            lastPending_.erase(it);
+            batchCoalesced_ += 2;
+            coalesced_ += 2;
+            return;
+        }
+        if (event.event == NABTO_DEVICE_CONNECTION_EVENT_CLOSED && previous == NABTO_DEVICE_CONNECTION_EVENT_CHANNEL_CHANGED) {
+            last.event.event = NABTO_DEVICE_CONNECTION_EVENT_CLOSED;
+            batchCoalesced_++;
+            coalesced_++;
+            return;
+        }
+    }
+
+    if (pending_.size() >= capacity_ && removed_ > 0) {
+        compact();
+    }
+    if (pending_.size() >= capacity_) {
+        batchDropped_++;
+        dropped_++;
+        return;
+    }
+    lastPending_[event.ref] = pending_.size();
+    pending_.push_back(PendingEvent{event, false});
+}
+
+void ConnectionEventQueue::compact()
+{
+    size_t used = 0;
+    lastPending_.clear();
+    for (auto& p : pending_) {
+        if (!p.removed) {
+            lastPending_[p.event.ref] = used;
+            pending_[used++] = p;
+        }
+    }
+    pending_.resize(used);
+    removed_ = 0;
+}
+
+void ConnectionEventQueue::runDrain()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (;;) {
+        // events pending when stopped are still delivered
+        drainCv_.wait(lock, [this](){ return !pending_.empty() || stopped_; });
+        if (pending_.empty()) {
+            return;
+        }
+        draining_.swap(pending_);
+        lastPending_.clear();
+        removed_ = 0;
+        batch_.coalesced = batchCoalesced_;
+        batch_.dropped = batchDropped_;
+        batchCoalesced_ = 0;
+        batchDropped_ = 0;
+        lock.unlock();
+
+        batch_.events.clear();
+        for (auto& p : draining_) {
+            if (!p.removed) {
+                batch_.events.push_back(p.event);
+            }
+        }
+        draining_.clear();
+        handler_(batch_);
+
+        lock.lock();
+    }
+}
+
+uint64_t ConnectionEventQueue::received()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    return received_;
+}
+
+uint64_t ConnectionEventQueue::coalesced()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    return coalesced_;
+}
+
+uint64_t ConnectionEventQueue::dropped()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    return dropped_;
+}
+
+} } // namespace
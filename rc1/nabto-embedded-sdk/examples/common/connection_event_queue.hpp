@@ -0,0 +1,112 @@
+#pragma once
+
+#include <nabto/nabto_device.h>
+
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace nabto {
+namespace common {
+
+struct ConnectionEvent {
+    NabtoDeviceConnectionRef ref;
+    NabtoDeviceConnectionEvent event;
+};
+
+/**
+ * The connection events received since the previous batch. coalesced
+ * counts events which were merged with an earlier event for the same
+ * connection, dropped counts events which were lost because the queue
+ * was full. If dropped is not 0 the state derived from the events, e.g.
+ * the set of open connections, can be wrong.
+ */
+struct ConnectionEventBatch {
+    std::vector<ConnectionEvent> events;
+    uint64_t coalesced = 0;
+    uint64_t dropped = 0;
+};
+
+typedef std::function<void (const ConnectionEventBatch& batch)> ConnectionEventHandler;
+
+/**
+ * Listens for connection events and delivers them in batches on a
+ * thread of its own, so a full executor cannot hold events back. The
+ * core thread only copies the event into the queue and listens for the
+ * next one, the handler is invoked once per batch instead of once per
+ * event. Batches are delivered one at a time and in order.
+ *
+ * Pending events for the same connection are merged: repeated channel
+ * changes become one, a channel change after an open is dropped, and
+ * an open followed by a close removes both. When capacity events are
+ * pending after merging, further events are dropped until the handler
+ * has taken the batch.
+ */
+class ConnectionEventQueue {
+ public:
+    ConnectionEventQueue(NabtoDevice* device, size_t capacity, ConnectionEventHandler handler);
+    ~ConnectionEventQueue() {
+        stop();
+        nabto_device_listener_free(listener_);
+        nabto_device_future_free(future_);
+    }
+
+    /**
+     * Stop listening and wait until the pending events are handled.
+     */
+    void stop();
+
+    /**
+     * Totals since the queue was created, safe to call from any thread.
+     */
+    uint64_t received();
+    uint64_t coalesced();
+    uint64_t dropped();
+
+ private:
+    struct PendingEvent {
+        ConnectionEvent event;
+        bool removed;
+    };
+
+    void startListen();
+    static void eventCallback(NabtoDeviceFuture* fut, NabtoDeviceError ec, void* data);
+    void push(const ConnectionEvent& event);
+    // add or merge the event into pending_, called with mutex_ held
+    void enqueue(const ConnectionEvent& event);
+    // remove the merged away events from pending_, called with mutex_ held
+    void compact();
+    void runDrain();
+
+    NabtoDeviceListener* listener_;
+    NabtoDeviceFuture* future_;
+    ConnectionEvent event_;
+    ConnectionEventHandler handler_;
+    size_t capacity_;
+
+    std::mutex mutex_;
+    // protected by mutex_
+    std::vector<PendingEvent> pending_;
+    // index in pending_ of the last pending event for each connection
+    std::map<NabtoDeviceConnectionRef, size_t> lastPending_;
+    // events in pending_ which were merged away
+    size_t removed_ = 0;
+    bool stopped_ = false;
+    uint64_t batchCoalesced_ = 0;
+    uint64_t batchDropped_ = 0;
+    uint64_t received_ = 0;
+    uint64_t coalesced_ = 0;
+    uint64_t dropped_ = 0;
+
+    // only used by the drain thread
+    std::vector<PendingEvent> draining_;
+    ConnectionEventBatch batch_;
+
+    std::condition_variable drainCv_;
+    std::thread drainThread_;
+};
+
+} } // namespace
@@ -0,0 +1,57 @@
+#include "connection_quota.hpp"
+
+namespace nabto {
+namespace common {
+
+bool ConnectionQuota::acquire(NabtoDeviceConnectionRef ref)
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    size_t& count = perConnection_[ref];
+    if ((maxPerConnection_ != 0 && count >= maxPerConnection_) ||
+        (maxTotal_ != 0 && total_ >= maxTotal_))
+    {
+        if (count == 0) {
+            perConnection_.erase(ref);
+        }
+        rejected_++;
+        return false;
+    }
+    count++;
+    total_++;
+    return true;
+}
+
+void ConnectionQuota::release(NabtoDeviceConnectionRef ref)
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    auto it = perConnection_.find(ref);
+    if (it == perConnection_.end()) {
+        return;
+    }
+    total_--;
+    // entries are removed when they reach zero so closed connections
+    // do not accumulate.
+    if (--it->second == 0) {
+        perConnection_.erase(it);
+    }
+}
+
+size_t ConnectionQuota::inUse()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    return total_;
+}
+
+size_t ConnectionQuota::connections()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    return perConnection_.size();
+}
+
+uint64_t ConnectionQuota::rejected()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    return rejected_;
+}
+
+} } // namespace
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <nabto/nabto_device.h>
+
+#include <map>
+#include <mutex>
+
+namespace nabto {
+namespace common {
+
+/**
+ * Counts a resource, e.g. open streams or CoAP requests in flight,
+ * per connection and for the whole device. acquire fails when either
+ * the connection or the device is at its limit, such that one client
+ * cannot use up all the resources of the device. A limit of 0 means
+ * unlimited.
+ */
+class ConnectionQuota {
+ public:
+    ConnectionQuota(size_t maxPerConnection, size_t maxTotal)
+        : maxPerConnection_(maxPerConnection), maxTotal_(maxTotal)
+    {
+    }
+
+    /**
+     * Take one unit of the resource for the connection.
+     *
+     * @return false if the connection or the device is at its limit.
+     */
+    bool acquire(NabtoDeviceConnectionRef ref);
+
+    /**
+     * Give back a unit taken with acquire.
+     */
+    void release(NabtoDeviceConnectionRef ref);
+
+    /**
+     * Current load, safe to call from any thread.
+     */
+    size_t inUse();
+    size_t connections();
+    uint64_t rejected();
+
+ private:
+    std::mutex mutex_;
+    std::map<NabtoDeviceConnectionRef, size_t> perConnection_;
+    size_t maxPerConnection_;
+    size_t maxTotal_;
+    size_t total_ = 0;
+    uint64_t rejected_ = 0;
+};
+
+} } // namespace
@@ -0,0 +1,13 @@
+#include "device_config.hpp"
+
+bool device_config_get_fingerprint(NabtoDevice* device, std::string& fingerprint)
+{
+    char* fp;
+    NabtoDeviceError ec = nabto_device_get_device_fingerprint_hex(device, &fp);
+    if (ec) {
+        return false;
+    }
+    fingerprint = std::string(fp);
+    nabto_device_string_free(fp);
+    return true;
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <nabto/nabto_device.h>
+
+#include <string>
+
+/**
+ * Get the fingerprint of the device key. It is derived from the private
+ * key set on the device rather than stored in the config, a stored copy
+ * would go stale when the key is replaced and the lookup only costs
+ * some tens of microseconds once at startup.
+ *
+ * @return false if the fingerprint could not be retrieved, e.g. because
+ * no private key has been set.
+ */
+bool device_config_get_fingerprint(NabtoDevice* device, std::string& fingerprint);
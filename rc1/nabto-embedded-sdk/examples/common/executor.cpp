@@ -0,0 +1,64 @@
+#include "executor.hpp"
+
+namespace nabto {
+namespace common {
+
+WorkerPool::WorkerPool(size_t threads, size_t maxQueued)
+    : maxQueued_(maxQueued)
+{
+    for (size_t i = 0; i < threads; i++) {
+        threads_.push_back(std::thread(&WorkerPool::run, this));
+    }
+}
+
+WorkerPool::~WorkerPool()
+{
+    stop();
+}
+
+bool WorkerPool::post(std::function<void ()> work)
+{
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (stopped_ || threads_.empty() || queue_.size() >= maxQueued_) {
+            return false;
+        }
+        queue_.push_back(work);
+    }
+    cv_.notify_one();
+    return true;
+}
+
+void WorkerPool::stop()
+{
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        stopped_ = true;
+    }
+    cv_.notify_all();
+    for (auto& t : threads_) {
+        if (t.joinable()) {
+            t.join();
+        }
+    }
+}
+
+void WorkerPool::run()
+{
+    for (;;) {
+        std::function<void ()> work;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            cv_.wait(lock, [this](){ return stopped_ || !queue_.empty(); });
+            if (queue_.empty()) {
+                // stopped and drained
+                return;
+            }
+            work = queue_.front();
+            queue_.pop_front();
+        }
+        work();
+    }
+}
+
+} } // namespace
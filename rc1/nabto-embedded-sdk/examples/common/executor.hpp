@@ -0,0 +1,59 @@
+#pragma once
+
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <thread>
+#include <vector>
+
+namespace nabto {
+namespace common {
+
+/**
+ * Runs work outside of the Nabto core thread. Future callbacks must
+ * never block, so handlers which do slow work (disk io, waiting for
+ * user input) post that work to an executor instead.
+ */
+class Executor {
+ public:
+    virtual ~Executor() {}
+
+    /**
+     * Queue work for execution.
+     *
+     * @return false if the work could not be queued, in that case the
+     * caller still owns any resources the work was supposed to release.
+     */
+    virtual bool post(std::function<void ()> work) = 0;
+};
+
+/**
+ * Executor backed by a fixed number of worker threads and a bounded
+ * queue.
+ */
+class WorkerPool : public Executor {
+ public:
+    WorkerPool(size_t threads, size_t maxQueued);
+    ~WorkerPool();
+
+    bool post(std::function<void ()> work);
+
+    /**
+     * Run the remaining queued work and join the worker threads. No
+     * new work is accepted after stop has been called.
+     */
+    void stop();
+
+ private:
+    void run();
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<std::function<void ()> > queue_;
+    std::vector<std::thread> threads_;
+    size_t maxQueued_;
+    bool stopped_ = false;
+};
+
+} } // namespace
@@ -0,0 +1,66 @@
+#include "iam_image.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+std::string iam_image_file(const std::string& configFile)
+{
+    return configFile + ".iam";
+}
+
+bool iam_image_save(const std::string& fileName, const std::vector<uint8_t>& image)
+{
+    std::string tmpFile = fileName + ".tmp";
+    {
+        std::ofstream out(tmpFile, std::ios::binary | std::ios::trunc);
+        out.write((const char*)image.data(), image.size());
+        if (!out) {
+            std::remove(tmpFile.c_str());
+            return false;
+        }
+    }
+    return std::rename(tmpFile.c_str(), fileName.c_str()) == 0;
+}
+
+NabtoDeviceError iam_image_load_device(NabtoDevice* device, const std::string& configFile, const json& config)
+{
+    std::string fileName = iam_image_file(configFile);
+    int fd = open(fileName.c_str(), O_RDONLY);
+    if (fd < 0 && errno != ENOENT) {
+        // Falling back to the config would load an old iam which the
+        // next save writes over the image.
+        std::cerr << "Could not open the iam image " << fileName << ": " << strerror(errno) << std::endl;
+        return NABTO_DEVICE_EC_UNKNOWN;
+    }
+    if (fd < 0) {
+        auto iam = config.find("Iam");
+        if (iam == config.end()) {
+            return NABTO_DEVICE_EC_NO_DATA;
+        }
+        std::vector<uint8_t> cbor = json::to_cbor(*iam);
+        return nabto_device_iam_load(device, cbor.data(), cbor.size());
+    }
+
+    // The image is mapped and given to the device without copying it.
+    // The mapping is private and writable since iam_load takes a non
+    // const pointer, the file is never modified.
+    NabtoDeviceError ec = NABTO_DEVICE_EC_UNKNOWN;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        void* image = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if (image != MAP_FAILED) {
+            ec = nabto_device_iam_load(device, image, st.st_size);
+            munmap(image, st.st_size);
+        }
+    }
+    close(fd);
+    return ec;
+}
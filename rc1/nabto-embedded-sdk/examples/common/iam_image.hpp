@@ -0,0 +1,38 @@
+#pragma once
+
+#include <nabto/nabto_device.h>
+#include <nabto/nabto_device_experimental.h>
+
+#include <nlohmann/json.hpp>
+
+#include <string>
+#include <vector>
+
+using json = nlohmann::json;
+
+/**
+ * The IAM database of a device is stored next to its json config as the
+ * CBOR returned by nabto_device_iam_dump. The file is handed to
+ * nabto_device_iam_load as is at startup, so a large user list is not
+ * parsed as json and converted to CBOR before the device parses it.
+ */
+
+/**
+ * Name of the IAM image belonging to a config file.
+ */
+std::string iam_image_file(const std::string& configFile);
+
+/**
+ * Write an IAM image. The image is written to a temporary file which is
+ * renamed, so a crash does not leave a truncated image.
+ */
+bool iam_image_save(const std::string& fileName, const std::vector<uint8_t>& image);
+
+/**
+ * Load the IAM of a device from the image belonging to configFile. If
+ * there is no image the "Iam" section of the config is used, such that
+ * configs written before the image existed still work. Any other error
+ * opening the image is returned, the device must not run and save its
+ * IAM over an image which could not be read.
+ */
+NabtoDeviceError iam_image_load_device(NabtoDevice* device, const std::string& configFile, const json& config);
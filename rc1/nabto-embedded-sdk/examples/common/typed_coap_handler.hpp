@@ -0,0 +1,77 @@
+#pragma once
+
+#include "coap_request_handler.hpp"
+#include "cbor_codec.hpp"
+
+#include <nabto/nabto_device.h>
+#include <nabto/nabto_device_experimental.h>
+
+#include <functional>
+#include <string>
+
+namespace nabto {
+namespace common {
+
+/**
+ * Handler for a request with a CBOR payload of type T. It is invoked
+ * with the decoded payload and returns the response code, e.g. 204.
+ */
+template<typename T>
+using TypedCoapHandlerFunction = std::function<uint16_t (const T& value, void* application)>;
+
+/**
+ * Create a CoapHandler which does the steps every POST resource of the
+ * examples needs before the application code runs: check the IAM
+ * action, require application/cbor, decode the payload into T with
+ * cbor_codec and respond. Use it with the CoapRequestHandler
+ * constructors, e.g.
+ *
+ *   std::make_unique<CoapRequestHandler>(app, device, NABTO_DEVICE_COAP_POST, path,
+ *       typed_coap_handler<bool>(device, "HeatPump:Set", &set_power), executor);
+ */
+template<typename T>
+CoapHandler typed_coap_handler(NabtoDevice* device, const std::string& action, TypedCoapHandlerFunction<T> handler)
+{
+    return [device, action, handler](NabtoDeviceCoapRequest* request, void* application) {
+        NabtoDeviceError effect = nabto_device_iam_check_action_attributes(
+            device, nabto_device_coap_request_get_connection_ref(request), action.c_str(), NULL, 0);
+        if (effect != NABTO_DEVICE_EC_OK) {
+            nabto_device_coap_error_response(request, 403, "Unauthorized");
+            nabto_device_coap_request_free(request);
+            return;
+        }
+
+        uint16_t contentFormat;
+        NabtoDeviceError ec = nabto_device_coap_request_get_content_format(request, &contentFormat);
+        if (ec || contentFormat != NABTO_DEVICE_COAP_CONTENT_FORMAT_APPLICATION_CBOR) {
+            nabto_device_coap_error_response(request, 400, "Invalid Content Format");
+            nabto_device_coap_request_free(request);
+            return;
+        }
+        void* payload;
+        size_t payloadSize;
+        if (nabto_device_coap_request_get_payload(request, &payload, &payloadSize) != NABTO_DEVICE_EC_OK) {
+            nabto_device_coap_error_response(request, 400, "Missing payload");
+            nabto_device_coap_request_free(request);
+            return;
+        }
+
+        T value;
+        if (cbor_codec_decode((const uint8_t*)payload, payloadSize, value) != CborNoError) {
+            nabto_device_coap_error_response(request, 400, "Bad request");
+            nabto_device_coap_request_free(request);
+            return;
+        }
+
+        uint16_t code = handler(value, application);
+        if (code >= 400) {
+            nabto_device_coap_error_response(request, code, "");
+        } else {
+            nabto_device_coap_response_set_code(request, code);
+            nabto_device_coap_response_ready(request);
+        }
+        nabto_device_coap_request_free(request);
+    };
+}
+
+} } // namespace
@@ -1,5 +1,6 @@
 #include "heat_pump.hpp"
 #include "json_config.hpp"
+#include "iam_image.hpp"
 
 #include <nabto/nabto_device.h>
 #include <nabto/nabto_device_experimental.h>
@@ -9,8 +10,11 @@
 #include <iostream>
 
 void HeatPump::init() {
+    pairingButton_.start();
+    saverThread_ = std::thread(&HeatPump::runSaver, this);
     listenForIamChanges();
-    listenForConnectionEvents();
+    connectionEvents_ = std::make_unique<nabto::common::ConnectionEventQueue>(device_, 1024,
+        [this](const nabto::common::ConnectionEventBatch& batch) { handleConnectionEvents(batch); });
     listenForDeviceEvents();
 }
 
@@ -20,9 +24,6 @@ bool validate_config(const json& config) {
         config["DeviceId"].get<std::string>();
         config["Server"].get<std::string>();
         config["PrivateKey"].get<std::string>();
-        config["Iam"]["Users"];
-        config["Iam"]["Roles"];
-        config["Iam"]["Policies"];
     } catch (std::exception& e) {
         return false;
     }
@@ -31,21 +32,40 @@ bool validate_config(const json& config) {
 
 void HeatPump::setMode(Mode mode)
 {
-    config_["HeatPump"]["Mode"] = modeToString(mode);
+    {
+        std::unique_lock<std::mutex> lock(configMutex_);
+        config_["HeatPump"]["Mode"] = modeToString(mode);
+        updateStateCbor();
+    }
     saveConfig();
 }
 void HeatPump::setTarget(double target)
 {
-    config_["HeatPump"]["Target"] = target;
+    {
+        std::unique_lock<std::mutex> lock(configMutex_);
+        config_["HeatPump"]["Target"] = target;
+        updateStateCbor();
+    }
     saveConfig();
 }
 
 void HeatPump::setPower(bool power)
 {
-    config_["HeatPump"]["Power"] = power;
+    {
+        std::unique_lock<std::mutex> lock(configMutex_);
+        config_["HeatPump"]["Power"] = power;
+        updateStateCbor();
+    }
     saveConfig();
 }
 
+void HeatPump::updateStateCbor()
+{
+    auto cbor = std::make_shared<const std::vector<uint8_t> >(json::to_cbor(config_["HeatPump"]));
+    std::unique_lock<std::mutex> lock(stateMutex_);
+    stateCbor_ = cbor;
+}
+
 const char* HeatPump::modeToString(HeatPump::Mode mode)
 {
     switch (mode) {
@@ -64,19 +84,115 @@ void HeatPump::iamChanged(NabtoDeviceFuture* fut, NabtoDeviceError err, void* us
         return;
     }
     HeatPump* hp = (HeatPump*)userData;
-    hp->saveConfig();
-    hp->listenForIamChanges();
+    {
+        std::unique_lock<std::mutex> lock(hp->mutex_);
+        hp->iamChangePending_ = true;
+        if (hp->iamBatch_) {
+            // endIamBatch saves and listens again
+            return;
+        }
+    }
+    // Saving touches the disk so it never runs on the core thread.
+    hp->requestSave();
+}
+
+void HeatPump::requestSave()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    saveRequested_ = true;
+    saverCv_.notify_one();
+}
+
+void HeatPump::stopSaver()
+{
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        saverStopped_ = true;
+        saverCv_.notify_one();
+    }
+    if (saverThread_.joinable()) {
+        saverThread_.join();
+    }
+}
+
+void HeatPump::runSaver()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (;;) {
+        saverCv_.wait(lock, [this](){ return saveRequested_ || saverStopped_; });
+        if (saveRequested_) {
+            // requests made while saving are merged into the next save
+            saveRequested_ = false;
+            lock.unlock();
+            saveConfig();
+            lock.lock();
+        } else {
+            return;
+        }
+    }
+}
+
+void HeatPump::beginIamBatch()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    iamBatch_ = true;
+}
+
+void HeatPump::endIamBatch()
+{
+    bool pending;
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        iamBatch_ = false;
+        pending = iamChangePending_;
+    }
+    // If the change notification has not arrived yet it is handled as
+    // usual when it does, either way the batch is saved once.
+    if (pending) {
+        saveConfig();
+    }
 }
 
 void HeatPump::listenForIamChanges()
 {
-    nabto_device_iam_listen_for_changes(device_, iamChangedFuture_, currentIamVersion_);
+    uint64_t version;
+    {
+        std::unique_lock<std::mutex> lock(fileMutex_);
+        version = currentIamVersion_;
+    }
+    nabto_device_iam_listen_for_changes(device_, iamChangedFuture_, version);
     nabto_device_future_set_callback(iamChangedFuture_, HeatPump::iamChanged, this);
 }
 
 void HeatPump::saveConfig()
 {
-    json config = config_;
+    // A pending iam change is included in this save, listen for the
+    // next one afterwards.
+    bool listen = false;
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (iamChangePending_ && !iamBatch_) {
+            iamChangePending_ = false;
+            listen = true;
+        }
+    }
+    writeConfig();
+    if (listen) {
+        listenForIamChanges();
+    }
+}
+
+void HeatPump::writeConfig()
+{
+    // The config is copied after the file lock is taken such that the
+    // last write has the newest state. The iam dump and the disk writes
+    // happen without configMutex_ so requests are not held up by them.
+    std::unique_lock<std::mutex> lock(fileMutex_);
+    json config;
+    {
+        std::unique_lock<std::mutex> configLock(configMutex_);
+        config = config_;
+    }
 
     uint64_t version;
     size_t used;
@@ -88,49 +204,45 @@ void HeatPump::saveConfig()
     if(nabto_device_iam_dump(device_, &version, buffer.data(), buffer.size(), &used) != NABTO_DEVICE_EC_OK) {
         return;
     }
-    config["Iam"] = json::from_cbor(buffer);
+    buffer.resize(used);
+    if (!iam_image_save(iam_image_file(configFile_), buffer)) {
+        std::cerr << "Could not save the iam image" << std::endl;
+        return;
+    }
+    // the iam is in the image, older configs also have it here
+    config.erase("Iam");
     currentIamVersion_ = version;
 
-    std::string tmpFile = "tmp.json";
     json_config_save(configFile_, config);
     std::cout << "Configuration saved to file" << std::endl;
 }
 
-void HeatPump::startWaitEvent()
-{
-    nabto_device_listener_connection_event(connectionEventListener_, connectionEventFuture_, &connectionRef_, &connectionEvent_);
-    nabto_device_future_set_callback(connectionEventFuture_, &HeatPump::connectionEvent, this);
-}
-
-void HeatPump::connectionEvent(NabtoDeviceFuture* fut, NabtoDeviceError err, void* userData)
+void HeatPump::handleConnectionEvents(const nabto::common::ConnectionEventBatch& batch)
 {
-    HeatPump* hp = (HeatPump*)userData;
-    if (err != NABTO_DEVICE_EC_OK) {
-        std::cout << "Connection event called back with error: " << err << std::endl;
-        return;
-    } else {
-        if (hp->connectionEvent_ == NABTO_DEVICE_CONNECTION_EVENT_OPENED) {
-            std::cout << "New connection opened with reference: " << hp->connectionRef_ << std::endl;
-        } else if (hp->connectionEvent_ == NABTO_DEVICE_CONNECTION_EVENT_CLOSED) {
-            std::cout << "Connection with reference: " << hp->connectionRef_ << " was closed" << std::endl;
-        } else if (hp->connectionEvent_ == NABTO_DEVICE_CONNECTION_EVENT_CHANNEL_CHANGED) {
-            std::cout << "Connection with reference: " << hp->connectionRef_ << " changed channel" << std::endl;
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        for (auto& e : batch.events) {
+            if (e.event == NABTO_DEVICE_CONNECTION_EVENT_OPENED) {
+                openConnections_.insert(e.ref);
+            } else if (e.event == NABTO_DEVICE_CONNECTION_EVENT_CLOSED) {
+                openConnections_.erase(e.ref);
+            }
+        }
+    }
+    for (auto& e : batch.events) {
+        if (e.event == NABTO_DEVICE_CONNECTION_EVENT_OPENED) {
+            std::cout << "New connection opened with reference: " << e.ref << std::endl;
+        } else if (e.event == NABTO_DEVICE_CONNECTION_EVENT_CLOSED) {
+            std::cout << "Connection with reference: " << e.ref << " was closed" << std::endl;
+        } else if (e.event == NABTO_DEVICE_CONNECTION_EVENT_CHANNEL_CHANGED) {
+            std::cout << "Connection with reference: " << e.ref << " changed channel" << std::endl;
         } else {
-            std::cout << "Unknown connection event: " << hp->connectionEvent_ << " on connection reference: " << hp->connectionRef_ << std::endl;
+            std::cout << "Unknown connection event: " << e.event << " on connection reference: " << e.ref << std::endl;
         }
     }
-    hp->startWaitEvent();
-
-}
-
-void HeatPump::listenForConnectionEvents()
-{
-    NabtoDeviceError ec = nabto_device_connection_events_init_listener(device_, connectionEventListener_);
-    if (ec) {
-        std::cerr << "Failed to init connection events listener" << std::endl;
-        return;
+    if (batch.coalesced || batch.dropped) {
+        std::cout << "Connection events coalesced: " << batch.coalesced << " dropped: " << batch.dropped << std::endl;
     }
-    startWaitEvent();
 }
 
 void HeatPump::startWaitDevEvent()
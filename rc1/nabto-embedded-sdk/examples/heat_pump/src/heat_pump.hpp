@@ -4,85 +4,66 @@
 #include <nabto/nabto_device.h>
 #include <nabto/nabto_device_experimental.h>
 
+#include "coap_request_handler.hpp"
+#include "executor.hpp"
+#include "connection_quota.hpp"
+#include "connection_event_queue.hpp"
+#include "pairing_button.hpp"
+
 #include <nlohmann/json.hpp>
 
+#include <condition_variable>
+#include <memory>
 #include <mutex>
+#include <set>
 #include <thread>
 #include <sstream>
+#include <vector>
 
 using json = nlohmann::json;
 
-class HeatPump;
-
-typedef std::function<void (NabtoDeviceCoapRequest* request, HeatPump* application)> CoapHandler;
-
-class HeatPumpCoapRequestHandler {
- public:
-    ~HeatPumpCoapRequestHandler() {
-        nabto_device_listener_free(listener_);
-        nabto_device_future_free(future_);
-    }
-    HeatPumpCoapRequestHandler(HeatPump* hp, NabtoDeviceCoapMethod methdod, const char** pathSegments, CoapHandler handler);
-
-    void startListen();
-
-    void stopListen() {
-        nabto_device_listener_stop(listener_);
-    }
-
-    static void requestCallback(NabtoDeviceFuture* fut, NabtoDeviceError ec, void* data)
-    {
-        HeatPumpCoapRequestHandler* handler = (HeatPumpCoapRequestHandler*)data;
-        if (ec != NABTO_DEVICE_EC_OK) {
-            return;
-        }
-        handler->handler_(handler->request_, handler->heatPump_);
-        handler->startListen();
-    }
-
-    HeatPump* heatPump_;
-    //  wait for a request
-    NabtoDeviceFuture* future_;
-    NabtoDeviceCoapRequest* request_;
-    // on this listener
-    NabtoDeviceListener* listener_;
-    // invoke this function if the resource is hit
-    CoapHandler handler_;
-};
-
 class HeatPump {
   public:
-
-    HeatPump(NabtoDevice* device, json config, const std::string& configFile)
-        : device_(device), config_(config), configFile_(configFile)
+    // work which can wait for a worker thread. Only the CoAP handlers
+    // use the pool, saving and connection events have threads of their
+    // own, so they cannot be starved by requests.
+    static const size_t MAX_QUEUED_WORK = 32;
+
+    HeatPump(NabtoDevice* device, json config, const std::string& configFile, size_t workerThreads, size_t maxRequestsPerConnection)
+        : device_(device), config_(config), configFile_(configFile), workerPool_(workerThreads, MAX_QUEUED_WORK),
+          // requests beyond what the pool can run or queue would only be
+          // rejected by the pool, so reject them before they get there.
+          requestQuota_(maxRequestsPerConnection, workerThreads + MAX_QUEUED_WORK)
     {
-        connectionEventListener_ = nabto_device_listener_new(device);
+        updateStateCbor();
         deviceEventListener_ = nabto_device_listener_new(device);
 
-        connectionEventFuture_ = nabto_device_future_new(device);
         deviceEventFuture_ = nabto_device_future_new(device);
         iamChangedFuture_ = nabto_device_future_new(device_);
 
     }
 
     ~HeatPump() {
-        nabto_device_future_free(connectionEventFuture_);
+        stopSaver();
         nabto_device_future_free(deviceEventFuture_);
         nabto_device_future_free(iamChangedFuture_);
 
-        nabto_device_listener_free(connectionEventListener_);
         nabto_device_listener_free(deviceEventListener_);
     }
 
     void init();
 
     void deinit() {
-        if (connectionEventListener_) {
-            nabto_device_listener_stop(connectionEventListener_);
+        if (connectionEvents_) {
+            connectionEvents_->stop();
         }
         if (deviceEventListener_) {
             nabto_device_listener_stop(deviceEventListener_);
         }
+        // rejects a waiting pairing such that no worker waits for input
+        pairingButton_.stop();
+        stopSaver();
+        workerPool_.stop();
     }
 
     enum class Mode {
@@ -103,9 +84,51 @@ class HeatPump {
     const char* modeToString(HeatPump::Mode mode);
     const char* getModeString();
     json getState() {
+        std::unique_lock<std::mutex> lock(configMutex_);
         return config_["HeatPump"];
     }
 
+    /**
+     * The state encoded as CBOR for GET /heat-pump. It is encoded when
+     * the state changes, not on every request.
+     */
+    std::shared_ptr<const std::vector<uint8_t> > getStateCbor() {
+        std::unique_lock<std::mutex> lock(stateMutex_);
+        return stateCbor_;
+    }
+
+    /**
+     * Executor for handlers which must not run on the core thread.
+     */
+    nabto::common::Executor* getExecutor() {
+        return &workerPool_;
+    }
+
+    /**
+     * Requests in progress per connection, shared by the CoAP handlers
+     * which run on the executor such that one connection cannot fill
+     * it.
+     */
+    nabto::common::ConnectionQuota* getRequestQuota() {
+        return &requestQuota_;
+    }
+
+    /**
+     * Connections which are open according to the connection events.
+     */
+    size_t openConnections() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        return openConnections_.size();
+    }
+
+    nabto::common::ConnectionEventQueue* getConnectionEvents() {
+        return connectionEvents_.get();
+    }
+
+    PairingButton* getPairingButton() {
+        return &pairingButton_;
+    }
+
     bool beginPairing() {
         std::unique_lock<std::mutex> lock(mutex_);
         if (pairing_) {
@@ -119,6 +142,15 @@ class HeatPump {
         pairing_ = false;
     }
 
+    /**
+     * Group several IAM changes, e.g. creating a user and adding its
+     * fingerprint and role, such that the configuration is saved once
+     * when the batch ends instead of once per change. Changes undone
+     * within the batch are never written to disk.
+     */
+    void beginIamBatch();
+    void endIamBatch();
+
     NabtoDeviceError userCount(size_t& count)
     {
         std::vector<uint8_t> cbor(1024);
@@ -156,46 +188,76 @@ class HeatPump {
         }
     }
 
-    std::unique_ptr<std::thread> pairingThread_;
-
-    std::unique_ptr<HeatPumpCoapRequestHandler> coapGetState;
-    std::unique_ptr<HeatPumpCoapRequestHandler> coapPostPower;
-    std::unique_ptr<HeatPumpCoapRequestHandler> coapPostMode;
-    std::unique_ptr<HeatPumpCoapRequestHandler> coapPostTarget;
-    std::unique_ptr<HeatPumpCoapRequestHandler> coapPostPairingButton;
+    std::unique_ptr<nabto::common::CoapRequestHandler> coapGetState;
+    std::unique_ptr<nabto::common::CoapRequestHandler> coapGetLoad;
+    std::unique_ptr<nabto::common::CoapRequestHandler> coapPostPower;
+    std::unique_ptr<nabto::common::CoapRequestHandler> coapPostMode;
+    std::unique_ptr<nabto::common::CoapRequestHandler> coapPostTarget;
+    std::unique_ptr<nabto::common::CoapRequestHandler> coapPostPairingButton;
 
   private:
 
     static void iamChanged(NabtoDeviceFuture* fut, NabtoDeviceError err, void* userData);
     void listenForIamChanges();
 
-    static void connectionEvent(NabtoDeviceFuture* fut, NabtoDeviceError err, void* userData);
-    void listenForConnectionEvents();
-    void startWaitEvent();
+    void handleConnectionEvents(const nabto::common::ConnectionEventBatch& batch);
 
     static void deviceEvent(NabtoDeviceFuture* fut, NabtoDeviceError err, void* userData);
     void listenForDeviceEvents();
     void startWaitDevEvent();
 
+    // the saver thread writes the config after iam changes, it has a
+    // single request slot so asking for a save never fails.
+    void runSaver();
+    void requestSave();
+    void stopSaver();
+
     void saveConfig();
+    void writeConfig();
+    // must be called with configMutex_ held, or from the constructor
+    void updateStateCbor();
 
     std::mutex mutex_;
+    // protects config_, never held while the disk is written
+    std::mutex configMutex_;
+    // protects stateCbor_, such that GET /heat-pump only waits for the
+    // pointer to be swapped
+    std::mutex stateMutex_;
+    // serializes writes of the config and iam files, protects
+    // currentIamVersion_
+    std::mutex fileMutex_;
     NabtoDevice* device_;
     json config_;
+    std::shared_ptr<const std::vector<uint8_t> > stateCbor_;
     const std::string& configFile_;
     bool pairing_ = false;
+    // protected by mutex_
+    bool iamBatch_ = false;
+    // an iam change has not been saved yet and the iam is not listened
+    // on until it is.
+    bool iamChangePending_ = false;
+    // protected by fileMutex_
     uint64_t currentIamVersion_;
 
-    NabtoDeviceListener* connectionEventListener_;
-    NabtoDeviceFuture* connectionEventFuture_;
-    NabtoDeviceConnectionRef connectionRef_;
-    NabtoDeviceConnectionEvent connectionEvent_;
+    std::thread saverThread_;
+    std::condition_variable saverCv_;
+    // protected by mutex_
+    bool saveRequested_ = false;
+    bool saverStopped_ = false;
+
+    // protected by mutex_
+    std::set<NabtoDeviceConnectionRef> openConnections_;
 
     NabtoDeviceListener* deviceEventListener_;
     NabtoDeviceFuture* deviceEventFuture_;
     NabtoDeviceEvent deviceEvent_;
 
     NabtoDeviceFuture* iamChangedFuture_;
+
+    std::unique_ptr<nabto::common::ConnectionEventQueue> connectionEvents_;
+    PairingButton pairingButton_;
+    nabto::common::WorkerPool workerPool_;
+    nabto::common::ConnectionQuota requestQuota_;
 };
 
 #endif
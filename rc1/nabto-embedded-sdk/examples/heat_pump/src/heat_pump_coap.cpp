@@ -1,55 +1,70 @@
 #include "heat_pump_coap.hpp"
 #include "heat_pump.hpp"
+#include "typed_coap_handler.hpp"
 #include "nabto/nabto_device.h"
 #include "nabto/nabto_device_experimental.h"
 
 #include <stdlib.h>
 #include <stdbool.h>
-#include <cbor.h>
-#include <cbor_extra.h>
 
-#include <mutex>
-#include <thread>
-#include <condition_variable>
+#include <chrono>
 #include <iostream>
 
-void heat_pump_set_power(NabtoDeviceCoapRequest* request, void* userData);
-void heat_pump_set_mode(NabtoDeviceCoapRequest* request, void* userData);
-void heat_pump_set_target(NabtoDeviceCoapRequest* request, void* userData);
-void heat_pump_get(NabtoDeviceCoapRequest* request, void* userData);
-void heat_pump_pairing_button(NabtoDeviceCoapRequest* request, void* userData);
+namespace nabto {
+namespace common {
+
+template<>
+struct CborEnum<HeatPump::Mode> {
+    static const CborEnumEntry<HeatPump::Mode>* entries(size_t& count) {
+        static const CborEnumEntry<HeatPump::Mode> e[] = {
+            cbor_enum_entry("COOL", HeatPump::Mode::COOL),
+            cbor_enum_entry("HEAT", HeatPump::Mode::HEAT),
+            cbor_enum_entry("FAN", HeatPump::Mode::FAN),
+            cbor_enum_entry("DRY", HeatPump::Mode::DRY)
+        };
+        count = sizeof(e) / sizeof(e[0]);
+        return e;
+    }
+};
 
+} } // namespace
 
-HeatPumpCoapRequestHandler::HeatPumpCoapRequestHandler(HeatPump* hp, NabtoDeviceCoapMethod method, const char** pathSegments, CoapHandler handler)
-    : heatPump_(hp), handler_(handler)
-{
-    future_ = nabto_device_future_new(hp->getDevice());
-    listener_ = nabto_device_listener_new(hp->getDevice());
-    if (!future_ || !listener_) {
-        return;
-    }
-    nabto_device_coap_init_listener(hp->getDevice(), listener_, method, pathSegments);
-    startListen();
-}
+uint16_t heat_pump_set_power(const bool& power, void* userData);
+uint16_t heat_pump_set_mode(const HeatPump::Mode& mode, void* userData);
+uint16_t heat_pump_set_target(const double& target, void* userData);
+void heat_pump_get(NabtoDeviceCoapRequest* request, void* userData);
+void heat_pump_get_load(NabtoDeviceCoapRequest* request, void* userData);
+void heat_pump_pairing_button(NabtoDeviceCoapRequest* request, void* userData);
 
-void HeatPumpCoapRequestHandler::startListen()
-{
-    nabto_device_listener_new_coap_request(listener_, future_, &request_);
-    nabto_device_future_set_callback(future_, HeatPumpCoapRequestHandler::requestCallback, this);
-}
 
 void heat_pump_coap_init(NabtoDevice* device, HeatPump* heatPump)
 {
     const char* getState[] = { "heat-pump", NULL };
+    const char* getLoad[] = { "heat-pump", "load", NULL };
     const char* postPower[] = { "heat-pump", "power", NULL };
     const char* postMode[] = { "heat-pump", "mode", NULL };
     const char* postTarget[] = { "heat-pump", "target", NULL };
     const char* postPairingButton[] = { "pairing", "button", NULL };
-    heatPump->coapGetState = std::make_unique<HeatPumpCoapRequestHandler>(heatPump, NABTO_DEVICE_COAP_GET, getState, &heat_pump_get);
-    heatPump->coapPostPower = std::make_unique<HeatPumpCoapRequestHandler>(heatPump, NABTO_DEVICE_COAP_POST, postPower, &heat_pump_set_power);
-    heatPump->coapPostMode = std::make_unique<HeatPumpCoapRequestHandler>(heatPump, NABTO_DEVICE_COAP_POST, postMode, &heat_pump_set_mode);
-    heatPump->coapPostTarget = std::make_unique<HeatPumpCoapRequestHandler>(heatPump, NABTO_DEVICE_COAP_POST, postTarget, &heat_pump_set_target);
-    heatPump->coapPostPairingButton = std::make_unique<HeatPumpCoapRequestHandler>(heatPump, NABTO_DEVICE_COAP_POST, postPairingButton, &heat_pump_pairing_button);
+    // The POST handlers save the configuration to disk and the pairing
+    // handler waits for user input, so they run on the executor.
+    nabto::common::Executor* executor = heatPump->getExecutor();
+    heatPump->coapGetState = std::make_unique<nabto::common::CoapRequestHandler>(heatPump, device, NABTO_DEVICE_COAP_GET, getState, &heat_pump_get);
+    heatPump->coapPostPower = std::make_unique<nabto::common::CoapRequestHandler>(heatPump, device, NABTO_DEVICE_COAP_POST, postPower,
+        nabto::common::typed_coap_handler<bool>(device, "HeatPump:Set", &heat_pump_set_power), executor);
+    heatPump->coapPostMode = std::make_unique<nabto::common::CoapRequestHandler>(heatPump, device, NABTO_DEVICE_COAP_POST, postMode,
+        nabto::common::typed_coap_handler<HeatPump::Mode>(device, "HeatPump:Set", &heat_pump_set_mode), executor);
+    heatPump->coapPostTarget = std::make_unique<nabto::common::CoapRequestHandler>(heatPump, device, NABTO_DEVICE_COAP_POST, postTarget,
+        nabto::common::typed_coap_handler<double>(device, "HeatPump:Set", &heat_pump_set_target), executor);
+    heatPump->coapPostPairingButton = std::make_unique<nabto::common::CoapRequestHandler>(heatPump, device, NABTO_DEVICE_COAP_POST, postPairingButton, &heat_pump_pairing_button, executor);
+    heatPump->coapGetLoad = std::make_unique<nabto::common::CoapRequestHandler>(heatPump, device, NABTO_DEVICE_COAP_GET, getLoad, &heat_pump_get_load);
+
+    // The GET handlers answer on the core thread without touching the
+    // executor, so only the requests which are posted count.
+    nabto::common::ConnectionQuota* quota = heatPump->getRequestQuota();
+    heatPump->coapPostPower->setQuota(quota);
+    heatPump->coapPostMode->setQuota(quota);
+    heatPump->coapPostTarget->setQuota(quota);
+    heatPump->coapPostPairingButton->setQuota(quota);
 }
 
 void heat_pump_coap_deinit(HeatPump* heatPump)
@@ -59,19 +74,7 @@ void heat_pump_coap_deinit(HeatPump* heatPump)
     heatPump->coapPostMode->stopListen();
     heatPump->coapPostTarget->stopListen();
     heatPump->coapPostPairingButton->stopListen();
-}
-
-void heat_pump_coap_send_bad_request(NabtoDeviceCoapRequest* request)
-{
-    nabto_device_coap_error_response(request, 400, "Bad request");
-    nabto_device_coap_request_free(request);
-}
-
-void heat_pump_coap_send_ok(NabtoDeviceCoapRequest* request, uint16_t code)
-{
-     nabto_device_coap_response_set_code(request, code);
-     nabto_device_coap_response_ready(request);
-     nabto_device_coap_request_free(request);
+    heatPump->coapGetLoad->stopListen();
 }
 
 // return true if action was allowed
@@ -89,50 +92,6 @@ bool heat_pump_coap_check_action(NabtoDevice* device, NabtoDeviceCoapRequest* re
     return true;
 }
 
-bool heat_pump_init_cbor_parser(NabtoDeviceCoapRequest* request, CborParser* parser, CborValue* cborValue)
-{
-    uint16_t contentFormat;
-    NabtoDeviceError ec;
-    ec = nabto_device_coap_request_get_content_format(request, &contentFormat);
-    if (ec || contentFormat != NABTO_DEVICE_COAP_CONTENT_FORMAT_APPLICATION_CBOR) {
-        nabto_device_coap_error_response(request, 400, "Invalid Content Format");
-        nabto_device_coap_request_free(request);
-        return false;
-    }
-    void* payload;
-    size_t payloadSize;
-    if (nabto_device_coap_request_get_payload(request, &payload, &payloadSize) != NABTO_DEVICE_EC_OK) {
-        nabto_device_coap_error_response(request, 400, "Missing payload");
-        nabto_device_coap_request_free(request);
-        return false;
-    }
-    cbor_parser_init((const uint8_t*)payload, payloadSize, 0, parser, cborValue);
-    return true;
-}
-
-std::condition_variable cv;
-bool answer;
-
-void readInput()
-{
-    for(;;) {
-        char c;
-        std::cin >> c;
-        if (c == 'n') {
-            answer = false;
-            cv.notify_one();
-            return;
-        } else if (c == 'y') {
-            answer = true;
-            cv.notify_one();
-            return;
-        } else {
-            std::cout << "valid answers y or n" << std::endl;
-        }
-    }
-
-}
-
 /**
  * Add a user with a given fingerprint to the system.
  */
@@ -182,9 +141,10 @@ bool pairUser( HeatPump* application, const std::string& fingerprint)
 /**
  * Ask the user a question in the terminal whether the user wants the
  * accept the client with the given fingerprint as a user on the
- * system.
+ * system. The answer is handled on the pairing button thread, this
+ * function returns without waiting for it.
  */
-void questionHandler(NabtoDeviceCoapRequest* request, HeatPump* application, bool asOwner)
+void questionHandler(NabtoDeviceCoapRequest* request, HeatPump* application)
 {
     if (!application->beginPairing()) {
         nabto_device_coap_error_response(request, 403, "Already Pairing or paired");
@@ -197,27 +157,29 @@ void questionHandler(NabtoDeviceCoapRequest* request, HeatPump* application, boo
 
     std::string fp(fingerprint);
     nabto_device_string_free(fingerprint);
-    std::cout << "Allow client with fingerprint: " << fp << " [yn]" << std::endl;
-
-    std::thread t(readInput);
-    t.detach();
-    std::mutex mtx;
-    std::unique_lock<std::mutex> lock(mtx);
-    bool result = false;
-    if (cv.wait_for(lock, std::chrono::seconds(60)) == std::cv_status::timeout) {
-        std::cout << "No input given defaulting to n" << std::endl;
-    } else {
-        result = answer;
-    }
 
-    if (result == true && pairUser(application, fp)) {
-        nabto_device_coap_response_set_code(request, 205);
-        nabto_device_coap_response_ready(request);
-    } else {
-        nabto_device_coap_error_response(request, 403, "Rejected");
+    auto answered = [request, application, fp](bool accepted) {
+        bool paired = false;
+        if (accepted) {
+            application->beginIamBatch();
+            paired = pairUser(application, fp);
+            application->endIamBatch();
+        }
+
+        if (paired) {
+            nabto_device_coap_response_set_code(request, 205);
+            nabto_device_coap_response_ready(request);
+        } else {
+            nabto_device_coap_error_response(request, 403, "Rejected");
+        }
+        nabto_device_coap_request_free(request);
+        application->pairingEnded();
+    };
+    if (!application->getPairingButton()->ask("Allow client with fingerprint: " + fp, std::chrono::seconds(60), answered)) {
+        nabto_device_coap_error_response(request, 503, "Service Unavailable");
+        nabto_device_coap_request_free(request);
+        application->pairingEnded();
     }
-    nabto_device_coap_request_free(request);
-    application->pairingEnded();
 }
 
 /**
@@ -225,7 +187,8 @@ void questionHandler(NabtoDeviceCoapRequest* request, HeatPump* application, boo
  *
  * The pairing asks the user for a confirmation that the client in
  * question is allowed to pair with the device. This simulates a
- * button on the device.
+ * button on the device. The request is answered when the user
+ * answers or the question times out.
  */
 void heat_pump_pairing_button(NabtoDeviceCoapRequest* request, void* userData)
 {
@@ -254,120 +217,83 @@ void heat_pump_pairing_button(NabtoDeviceCoapRequest* request, void* userData)
         return;
     }
 
-    application->pairingThread_ = std::make_unique<std::thread>(questionHandler, request, application, true);
-    application->pairingThread_->detach();
+    questionHandler(request, application);
 }
 
 // Change heat_pump power state (turn it on or off)
 /**
  * Coap POST /heat_pump/power,
- * Request, ContentFormat application/json
+ * Request, ContentFormat application/cbor
  * Data Boolean: true | false
- * Response, 200,
+ * Response, 204,
  */
-void heat_pump_set_power(NabtoDeviceCoapRequest* request, void* userData)
+uint16_t heat_pump_set_power(const bool& power, void* userData)
 {
     HeatPump* application = (HeatPump*)userData;
-
-    if (!heat_pump_coap_check_action(application->getDevice(), request, "HeatPump:Set")) {
-        return;
-    }
-
-    CborParser parser;
-    CborValue value;
-    if (!heat_pump_init_cbor_parser(request, &parser, &value)) {
-        return;
-    }
-
-    bool powerState;
-    if (!cbor_value_is_boolean(&value) || cbor_value_get_boolean(&value, &powerState) != CborNoError) {
-        nabto_device_coap_error_response(request, 400, "Invalid request");
-        nabto_device_coap_request_free(request);
-        return;
-    }
-
-    application->setPower(powerState);
-    heat_pump_coap_send_ok(request, 204);
+    application->setPower(power);
+    return 204;
 }
 
 // change heat_pump mode
 // CoAP post /heat_pump/mode
-// Data String: ("cool", "heat", "fan", "dry")
-void heat_pump_set_mode(NabtoDeviceCoapRequest* request, void* userData)
+// Data String: ("COOL", "HEAT", "FAN", "DRY")
+uint16_t heat_pump_set_mode(const HeatPump::Mode& mode, void* userData)
 {
     HeatPump* application = (HeatPump*)userData;
-    if (!heat_pump_coap_check_action(application->getDevice(), request, "HeatPump:Set")) {
-        return;
-    }
-
-    CborParser parser;
-    CborValue value;
-    if (!heat_pump_init_cbor_parser(request, &parser, &value)) {
-        return;
-    }
-
-    if (!cbor_value_is_text_string(&value)) {
-        return heat_pump_coap_send_bad_request(request);
-    }
-
-    const char* cool = "COOL";
-    const char* heat = "HEAT";
-    const char* fan = "FAN";
-    const char* dry = "DRY";
-    bool match;
-
-    if ((cbor_value_text_string_equals(&value, cool, &match) == CborNoError) && match) {
-        application->setMode(HeatPump::Mode::COOL);
-    } else if ((cbor_value_text_string_equals(&value, heat, &match) == CborNoError) && match) {
-        application->setMode(HeatPump::Mode::HEAT);
-    } else if ((cbor_value_text_string_equals(&value, fan, &match) == CborNoError) && match) {
-        application->setMode(HeatPump::Mode::FAN);
-    } else if ((cbor_value_text_string_equals(&value, dry, &match) == CborNoError) && match) {
-        application->setMode(HeatPump::Mode::DRY);
-    } else {
-        return heat_pump_coap_send_bad_request(request);
-    }
-    heat_pump_coap_send_ok(request, 204);
+    application->setMode(mode);
+    return 204;
 }
 
 // Set target temperature
 // CoAP POST /heat_pump/target
 // Data double tempereature
-void heat_pump_set_target(NabtoDeviceCoapRequest* request, void* userData)
+uint16_t heat_pump_set_target(const double& target, void* userData)
 {
     HeatPump* application = (HeatPump*)userData;
-    if (!heat_pump_coap_check_action(application->getDevice(), request, "HeatPump:Set")) {
-        return;
-    }
+    application->setTarget(target);
+    return 204;
+}
 
-    CborParser parser;
-    CborValue value;
-    if (!heat_pump_init_cbor_parser(request, &parser, &value)) {
+// Get heat_pump state
+// CoAP GET /heat_pump
+void heat_pump_get(NabtoDeviceCoapRequest* request, void* userData)
+{
+    HeatPump* application = (HeatPump*)userData;
+    if (!heat_pump_coap_check_action(application->getDevice(), request, "HeatPump:Get")) {
         return;
     }
 
-    if (!cbor_value_is_floating_point(&value)) {
-        return heat_pump_coap_send_bad_request(request);
-    }
+    auto d = application->getStateCbor();
 
-    double target;
-    if (cbor_value_get_floating_point(&value, &target) != CborNoError) {
-        return heat_pump_coap_send_bad_request(request);
+    nabto_device_coap_response_set_code(request, 205);
+    nabto_device_coap_response_set_content_format(request, NABTO_DEVICE_COAP_CONTENT_FORMAT_APPLICATION_CBOR);
+    NabtoDeviceError ec = nabto_device_coap_response_set_payload(request, d->data(), d->size());
+    if (ec != NABTO_DEVICE_EC_OK) {
+        nabto_device_coap_error_response(request, 500, "Insufficient resources");
+    } else {
+        nabto_device_coap_response_ready(request);
     }
-    application->setTarget(target);
-    heat_pump_coap_send_ok(request, 204);
+    nabto_device_coap_request_free(request);
 }
 
-// Get heat_pump state
-// CoAP GET /heat_pump
-void heat_pump_get(NabtoDeviceCoapRequest* request, void* userData)
+// Get the request load of the heat pump
+// CoAP GET /heat-pump/load
+void heat_pump_get_load(NabtoDeviceCoapRequest* request, void* userData)
 {
     HeatPump* application = (HeatPump*)userData;
     if (!heat_pump_coap_check_action(application->getDevice(), request, "HeatPump:Get")) {
         return;
     }
 
-    auto d = json::to_cbor(application->getState());
+    nabto::common::ConnectionQuota* quota = application->getRequestQuota();
+    json load;
+    load["RequestsInProgress"] = quota->inUse();
+    load["Connections"] = quota->connections();
+    load["RequestsRejected"] = quota->rejected();
+    load["OpenConnections"] = application->openConnections();
+    load["ConnectionEventsCoalesced"] = application->getConnectionEvents()->coalesced();
+    load["ConnectionEventsDropped"] = application->getConnectionEvents()->dropped();
+    auto d = json::to_cbor(load);
 
     nabto_device_coap_response_set_code(request, 205);
     nabto_device_coap_response_set_content_format(request, NABTO_DEVICE_COAP_CONTENT_FORMAT_APPLICATION_CBOR);
@@ -1,5 +1,7 @@
 #include "heat_pump.hpp"
 #include "json_config.hpp"
+#include "device_config.hpp"
+#include "iam_image.hpp"
 #include "heat_pump_iam_policies.hpp"
 #include "heat_pump_coap.hpp"
 
@@ -24,7 +26,7 @@ void my_handler(int s){
 }
 
 bool init_heat_pump(const std::string& configFile, const std::string& productId, const std::string& deviceId, const std::string& server);
-void run_heat_pump(const std::string& configFile);
+void run_heat_pump(const std::string& configFile, size_t workerThreads, size_t maxRequestsPerConnection);
 
 int main(int argc, char** argv) {
     cxxopts::Options options("Heat pump", "Nabto heat pump example.");
@@ -34,7 +36,9 @@ int main(int argc, char** argv) {
         ("i,init", "Initialize configuration file")
         ("c,config", "Configuration file", cxxopts::value<std::string>()->default_value("heat_pump_device.json"))
         ("log-level", "Log level to log (error|info|trace|debug)", cxxopts::value<std::string>()->default_value("info"))
-        ("log-file", "File to log to", cxxopts::value<std::string>()->default_value("heat_pump_device_log.txt"));
+        ("log-file", "File to log to", cxxopts::value<std::string>()->default_value("heat_pump_device_log.txt"))
+        ("worker-threads", "Threads for handlers which may block", cxxopts::value<size_t>()->default_value("2"))
+        ("max-requests-per-connection", "Max CoAP requests in progress from one connection, further requests get 503. 0 is no limit", cxxopts::value<size_t>()->default_value("8"));
 
     options.add_options("Init Parameters")
         ("p,product", "Product id", cxxopts::value<std::string>())
@@ -61,7 +65,7 @@ int main(int argc, char** argv) {
             }
         } else {
             std::string configFile = result["config"].as<std::string>();
-            run_heat_pump(configFile);
+            run_heat_pump(configFile, result["worker-threads"].as<size_t>(), result["max-requests-per-connection"].as<size_t>());
         }
     } catch (const cxxopts::OptionException& e) {
         std::cout << "Error parsing options: " << e.what() << std::endl;
@@ -135,7 +139,10 @@ bool init_heat_pump(const std::string& configFile, const std::string& productId,
         return false;
     }
 
-    config["Iam"] = defaultHeatPumpIam;
+    if (!iam_image_save(iam_image_file(configFile), iamCbor)) {
+        std::cerr << "Error saving the iam image" << std::endl;
+        return false;
+    }
 
     json_config_save(configFile, config);
 
@@ -149,7 +156,7 @@ bool init_heat_pump(const std::string& configFile, const std::string& productId,
     return true;
 }
 
-void run_heat_pump(const std::string& configFile)
+void run_heat_pump(const std::string& configFile, size_t workerThreads, size_t maxRequestsPerConnection)
 {
     NabtoDeviceError ec;
     json config;
@@ -164,7 +171,6 @@ void run_heat_pump(const std::string& configFile)
     auto deviceId  = config["DeviceId"].get<std::string>();
     auto server = config["Server"].get<std::string>();
     auto privateKey = config["PrivateKey"].get<std::string>();
-    auto iam = config["Iam"];
 
 
     ec = nabto_device_set_product_id(device, productId.c_str());
@@ -183,11 +189,14 @@ void run_heat_pump(const std::string& configFile)
     if (ec) {
         std::cerr << "Could not set private key" << std::endl;
     }
-    std::vector<uint8_t> iamCbor = json::to_cbor(iam);
-
-    ec = nabto_device_iam_load(device, iamCbor.data(), iamCbor.size());
-    if (ec) {
+    ec = iam_image_load_device(device, configFile, config);
+    if (ec == NABTO_DEVICE_EC_NO_DATA) {
+        std::cerr << "failed to load iam, the config has no iam" << std::endl;
+    } else if (ec) {
+        // do not save an empty iam over the image
         std::cerr << "failed to load iam" << std::endl;
+        nabto_device_free(device);
+        return;
     }
     ec = nabto_device_enable_mdns(device);
     if (ec) {
@@ -216,18 +225,15 @@ void run_heat_pump(const std::string& configFile)
         return;
     }
 
-    char* fpTemp;
-    ec = nabto_device_get_device_fingerprint_hex(device, &fpTemp);
-    if (ec) {
+    std::string fp;
+    if (!device_config_get_fingerprint(device, fp)) {
         std::cerr << "Could not get fingerprint of the device" << std::endl;
     }
-    std::string fp(fpTemp);
-    nabto_device_string_free(fpTemp);
 
     std::cout << "Device " << productId << "." << deviceId << " Started with fingerprint " << std::string(fp) << std::endl;
 
     {
-        HeatPump hp(device, config, configFile);
+        HeatPump hp(device, config, configFile, workerThreads, maxRequestsPerConnection);
         hp.init();
 
         heat_pump_coap_init(device, &hp);
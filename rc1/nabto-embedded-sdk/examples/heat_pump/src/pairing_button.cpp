@@ -0,0 +1,144 @@
+#include "pairing_button.hpp"
+
+#include <iostream>
+
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+
+PairingButton::PairingButton()
+{
+    if (pipe(wakeFds_) != 0) {
+        wakeFds_[0] = -1;
+        wakeFds_[1] = -1;
+    }
+}
+
+PairingButton::~PairingButton()
+{
+    stop();
+    if (wakeFds_[0] != -1) {
+        close(wakeFds_[0]);
+        close(wakeFds_[1]);
+    }
+}
+
+void PairingButton::start()
+{
+    thread_ = std::thread(&PairingButton::run, this);
+}
+
+bool PairingButton::ask(const std::string& question, std::chrono::seconds timeout, Callback callback)
+{
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (stopped_ || !thread_.joinable() || callback_) {
+            return false;
+        }
+        callback_ = callback;
+        deadline_ = std::chrono::steady_clock::now() + timeout;
+    }
+    std::cout << question << " [yn]" << std::endl;
+    wake();
+    return true;
+}
+
+void PairingButton::stop()
+{
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        stopped_ = true;
+    }
+    wake();
+    if (thread_.joinable()) {
+        thread_.join();
+    }
+}
+
+void PairingButton::wake()
+{
+    if (wakeFds_[1] != -1) {
+        char c = 0;
+        ssize_t ignored = write(wakeFds_[1], &c, 1);
+        (void)ignored;
+    }
+}
+
+void PairingButton::run()
+{
+    bool stdinOpen = true;
+    for (;;) {
+        Callback callback;
+        bool answer = false;
+        bool stopped;
+        int timeout = -1;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            stopped = stopped_;
+            if (stopped) {
+                callback.swap(callback_);
+            } else if (callback_) {
+                auto now = std::chrono::steady_clock::now();
+                if (now >= deadline_) {
+                    std::cout << "No input given defaulting to n" << std::endl;
+                    callback.swap(callback_);
+                } else {
+                    timeout = (int)std::chrono::duration_cast<std::chrono::milliseconds>(deadline_ - now).count() + 1;
+                }
+            }
+        }
+        if (callback) {
+            callback(false);
+        }
+        if (stopped) {
+            return;
+        }
+        if (callback) {
+            continue;
+        }
+
+        struct pollfd fds[2];
+        fds[0].fd = stdinOpen ? STDIN_FILENO : -1;
+        fds[0].events = POLLIN;
+        fds[0].revents = 0;
+        fds[1].fd = wakeFds_[0];
+        fds[1].events = POLLIN;
+        fds[1].revents = 0;
+        if (poll(fds, 2, timeout) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+        if (fds[1].revents) {
+            char buf[16];
+            ssize_t ignored = read(wakeFds_[0], buf, sizeof(buf));
+            (void)ignored;
+        }
+        if (!fds[0].revents) {
+            continue;
+        }
+        char buf[64];
+        ssize_t n = read(STDIN_FILENO, buf, sizeof(buf));
+        if (n <= 0) {
+            // no more input, questions time out
+            stdinOpen = false;
+            continue;
+        }
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            for (ssize_t i = 0; i < n && callback_; i++) {
+                char c = buf[i];
+                if (c == 'y' || c == 'n') {
+                    answer = (c == 'y');
+                    callback.swap(callback_);
+                } else if (c != ' ' && c != '\n' && c != '\r' && c != '\t') {
+                    std::cout << "valid answers y or n" << std::endl;
+                }
+            }
+        }
+        if (callback) {
+            callback(answer);
+        }
+    }
+}
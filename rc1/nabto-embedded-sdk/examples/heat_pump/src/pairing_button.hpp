@@ -0,0 +1,53 @@
+#ifndef _PAIRING_BUTTON_HPP_
+#define _PAIRING_BUTTON_HPP_
+
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+
+/**
+ * The pairing button of the heat pump, simulated with the console. A
+ * single thread reads the answers from stdin and times out unanswered
+ * questions, so a pairing request neither starts a thread of its own
+ * nor holds a worker thread while it waits for the user.
+ */
+class PairingButton {
+ public:
+    typedef std::function<void (bool accepted)> Callback;
+
+    PairingButton();
+    ~PairingButton();
+
+    void start();
+
+    /**
+     * Print the question and invoke callback with the answer, or with
+     * false if no answer is given within timeout. The callback is
+     * invoked on the button thread.
+     *
+     * @return false if a question is already waiting for an answer.
+     */
+    bool ask(const std::string& question, std::chrono::seconds timeout, Callback callback);
+
+    /**
+     * Answer a waiting question with false and join the button thread.
+     */
+    void stop();
+
+ private:
+    void run();
+    void wake();
+
+    std::mutex mutex_;
+    std::thread thread_;
+    // written to by wake() to interrupt the poll in run()
+    int wakeFds_[2];
+    // protected by mutex_
+    bool stopped_ = false;
+    Callback callback_;
+    std::chrono::steady_clock::time_point deadline_;
+};
+
+#endif
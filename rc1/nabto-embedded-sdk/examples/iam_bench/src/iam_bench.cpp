@@ -0,0 +1,467 @@
+#include <nabto/nabto_device.h>
+#include <nabto/nabto_device_experimental.h>
+
+#include "json_config.hpp"
+#include "coap_request_handler.hpp"
+
+#include <cxxopts.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <vector>
+
+#include <signal.h>
+#include <stdio.h>
+#include <unistd.h>
+
+const static uint16_t CONTENT_FORMAT_APPLICATION_JSON = 50;
+
+struct IamBenchConfig {
+    std::vector<size_t> userCounts;
+    size_t roles;
+    size_t policies;
+    size_t iterations;
+};
+
+static json run_offline(const IamBenchConfig& config);
+static json run_checks(NabtoDevice* device, const IamBenchConfig& config, NabtoDeviceConnectionRef ref, const std::string& fingerprint, size_t& users);
+static void run_iam_bench(const std::string& configFile, const std::string& logLevel, uint16_t localPort, const IamBenchConfig& config);
+
+/**
+ * Fake fingerprint for synthetic user i, same length as a real
+ * fingerprint in hex.
+ */
+static std::string user_fingerprint(size_t i)
+{
+    std::stringstream ss;
+    ss << std::hex << std::setw(32) << std::setfill('0') << i;
+    return ss.str();
+}
+
+static std::string user_name(size_t i)
+{
+    return "user-" + std::to_string(i);
+}
+
+static json synthetic_user(const IamBenchConfig& config, size_t i)
+{
+    return {
+        {"Roles", { "Role-" + std::to_string(i % config.roles), "Role-" + std::to_string((i + 1) % config.roles) }},
+        {"Fingerprints", { user_fingerprint(i) }}
+    };
+}
+
+/**
+ * Build an iam database with the given number of users. The policies
+ * have conditions on an attribute and on the user id such that the
+ * condition evaluation is part of the measured cost. Each user has
+ * two roles.
+ */
+static json synthetic_iam(const IamBenchConfig& config, size_t users)
+{
+    json iam;
+    iam["DefaultRole"] = "Role-0";
+    for (size_t p = 0; p < config.policies; p++) {
+        json policy;
+        policy["Version"] = 1;
+        policy["Statements"] = json::array();
+        policy["Statements"].push_back({
+                {"Allow", true},
+                {"Actions", { "Bench:Action" + std::to_string(p), "Bench:Get" }},
+                {"Conditions", {
+                        {{"NumberEqual", {{"Bench:Zone", (int)(p % 4)}}}}
+                    }}
+            });
+        policy["Statements"].push_back({
+                {"Allow", true},
+                {"Actions", { "Bench:Own" }},
+                {"Conditions", {
+                        {{"AttributeEqual", {{"Connection:UserId", "IAM:UserId"}}}}
+                    }}
+            });
+        iam["Policies"]["Policy-" + std::to_string(p)] = policy;
+    }
+    for (size_t r = 0; r < config.roles; r++) {
+        json policies = json::array();
+        for (size_t p = r; p < config.policies; p += config.roles) {
+            policies.push_back("Policy-" + std::to_string(p));
+        }
+        iam["Roles"]["Role-" + std::to_string(r)] = policies;
+    }
+    iam["Users"] = json::object();
+    for (size_t u = 0; u < users; u++) {
+        iam["Users"][user_name(u)] = synthetic_user(config, u);
+    }
+    return iam;
+}
+
+/**
+ * Add a user the same way as pairing does.
+ */
+static bool add_user(NabtoDevice* device, const IamBenchConfig& config, const std::string& name, const std::string& fingerprint, size_t i)
+{
+    return nabto_device_iam_users_create(device, name.c_str()) == NABTO_DEVICE_EC_OK &&
+        nabto_device_iam_users_add_fingerprint(device, name.c_str(), fingerprint.c_str()) == NABTO_DEVICE_EC_OK &&
+        nabto_device_iam_users_add_role(device, name.c_str(), ("Role-" + std::to_string(i % config.roles)).c_str()) == NABTO_DEVICE_EC_OK &&
+        nabto_device_iam_users_add_role(device, name.c_str(), ("Role-" + std::to_string((i + 1) % config.roles)).c_str()) == NABTO_DEVICE_EC_OK;
+}
+
+/**
+ * Mean time of f over at most iterations calls. Stops after about two
+ * seconds such that slow operations on large databases do not make
+ * the benchmark run for hours, ran is set to the number of calls made.
+ */
+template<typename F>
+static double mean_nanoseconds(size_t iterations, F f, size_t& ran)
+{
+    auto start = std::chrono::steady_clock::now();
+    auto deadline = start + std::chrono::seconds(2);
+    size_t i = 0;
+    while (i < iterations) {
+        f(i);
+        i++;
+        if (std::chrono::steady_clock::now() > deadline) {
+            break;
+        }
+    }
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    ran = i;
+    return (double)ns / i;
+}
+
+template<typename F>
+static double mean_nanoseconds(size_t iterations, F f)
+{
+    size_t ran;
+    return mean_nanoseconds(iterations, f, ran);
+}
+
+static bool load_iam(NabtoDevice* device, const json& iam, double& loadNs, size_t& cborSize)
+{
+    std::vector<uint8_t> cbor = json::to_cbor(iam);
+    cborSize = cbor.size();
+    NabtoDeviceError ec = NABTO_DEVICE_EC_OK;
+    loadNs = mean_nanoseconds(1, [&](size_t) {
+            ec = nabto_device_iam_load(device, cbor.data(), cbor.size());
+        });
+    if (ec) {
+        std::cerr << "Could not load an iam database with " << iam["Users"].size() << " users" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * nabto_device_iam_load merges into the existing database, so each
+ * size is measured on a new device.
+ */
+json run_offline(const IamBenchConfig& config)
+{
+    json results = json::array();
+    std::vector<uint8_t> buffer;
+    for (size_t users : config.userCounts) {
+        NabtoDevice* device = nabto_device_new();
+        json r;
+        r["users"] = users;
+        r["roles"] = config.roles;
+        r["policies"] = config.policies;
+
+        double loadNs;
+        size_t cborSize;
+        if (!load_iam(device, synthetic_iam(config, users), loadNs, cborSize)) {
+            nabto_device_stop(device);
+            nabto_device_free(device);
+            continue;
+        }
+        r["cborBytes"] = cborSize;
+        r["loadNanoseconds"] = loadNs;
+
+        uint64_t version;
+        size_t used = 0;
+        nabto_device_iam_dump(device, &version, NULL, 0, &used);
+        buffer.resize(used);
+        r["dumpBytes"] = used;
+        r["dumpNanoseconds"] = mean_nanoseconds(config.iterations, [&](size_t) {
+                nabto_device_iam_dump(device, &version, buffer.data(), buffer.size(), &used);
+            });
+
+        buffer.resize(1024);
+        r["usersGetNanoseconds"] = mean_nanoseconds(config.iterations, [&](size_t i) {
+                std::string name = user_name((i * 7919) % users);
+                nabto_device_iam_users_get(device, name.c_str(), buffer.data(), buffer.size(), &used);
+            });
+
+        // what pairing one more user costs at this size
+        size_t adds = std::min(config.iterations, (size_t)100);
+        r["userAddNanoseconds"] = mean_nanoseconds(adds, [&](size_t i) {
+                add_user(device, config, user_name(users + i), user_fingerprint(users + i), users + i);
+            });
+        results.push_back(r);
+
+        nabto_device_stop(device);
+        nabto_device_free(device);
+    }
+    return results;
+}
+
+/**
+ * Time the access checks for a real connection. The iam check needs a
+ * live connection, so this is run from a CoAP request on a worker
+ * thread, it takes seconds. The database is grown to each size by
+ * adding users like pairing does, the requesting client is (re)added
+ * as the newest user, which is the worst case for a linear search.
+ */
+json run_checks(NabtoDevice* device, const IamBenchConfig& config, NabtoDeviceConnectionRef ref, const std::string& fingerprint, size_t& users)
+{
+    std::vector<std::vector<uint8_t> > attributes;
+    for (int zone = 0; zone < 4; zone++) {
+        attributes.push_back(json::to_cbor(json({{"Bench:Zone", zone}})));
+    }
+    std::vector<std::string> actions;
+    for (size_t p = 0; p < config.policies; p++) {
+        actions.push_back("Bench:Action" + std::to_string(p));
+    }
+
+    std::vector<size_t> sizes = config.userCounts;
+    std::sort(sizes.begin(), sizes.end());
+
+    json results = json::array();
+    for (size_t size : sizes) {
+        // the client user cannot be deleted while it is in use by the
+        // connection, then it stays where it is.
+        NabtoDeviceError ec = nabto_device_iam_users_delete(device, "client");
+        bool readdClient = (ec == NABTO_DEVICE_EC_OK || ec == NABTO_DEVICE_EC_NOT_FOUND);
+        for (; users < size - 1; users++) {
+            if (!add_user(device, config, user_name(users), user_fingerprint(users), users)) {
+                std::cerr << "Could not add user " << users << std::endl;
+                return results;
+            }
+        }
+        if (readdClient && !add_user(device, config, "client", fingerprint, 0)) {
+            std::cerr << "Could not add the client as a user" << std::endl;
+            return results;
+        }
+
+        json r;
+        r["users"] = size;
+        size_t allowed = 0;
+        size_t checks = 0;
+        r["checkActionAttributesNanoseconds"] = mean_nanoseconds(config.iterations, [&](size_t i) {
+                std::vector<uint8_t>& attr = attributes[i % attributes.size()];
+                if (nabto_device_iam_check_action_attributes(device, ref, actions[i % actions.size()].c_str(), attr.data(), attr.size()) == NABTO_DEVICE_EC_OK) {
+                    allowed++;
+                }
+            }, checks);
+        r["checkActionNanoseconds"] = mean_nanoseconds(config.iterations, [&](size_t) {
+                nabto_device_iam_check_action(device, ref, "Bench:Own");
+            });
+        r["allowedRatio"] = (double)allowed / checks;
+        results.push_back(r);
+    }
+    return results;
+}
+
+class IamBench {
+ public:
+    IamBench(NabtoDevice* device, const IamBenchConfig& config)
+        : device_(device), config_(config), workerPool_(1, 1)
+    {
+        const char* checkPath[] = { "iam-bench", "check", NULL };
+        coapCheck_ = std::make_unique<nabto::common::CoapRequestHandler>(this, device_, NABTO_DEVICE_COAP_GET, checkPath, &IamBench::handleCheck, &workerPool_);
+    }
+
+    void stop()
+    {
+        coapCheck_->stopListen();
+        workerPool_.stop();
+    }
+
+    static void handleCheck(NabtoDeviceCoapRequest* request, void* userData)
+    {
+        IamBench* bench = (IamBench*)userData;
+        NabtoDeviceConnectionRef ref = nabto_device_coap_request_get_connection_ref(request);
+        char* fp;
+        if (nabto_device_connection_get_client_fingerprint_hex(bench->device_, ref, &fp) != NABTO_DEVICE_EC_OK) {
+            nabto_device_coap_error_response(request, 500, "Could not get client fingerprint");
+            nabto_device_coap_request_free(request);
+            return;
+        }
+        std::string fingerprint(fp);
+        nabto_device_string_free(fp);
+
+        json result = run_checks(bench->device_, bench->config_, ref, fingerprint, bench->users_);
+        std::cout << result.dump(2) << std::endl;
+
+        std::string payload = result.dump();
+        nabto_device_coap_response_set_code(request, 205);
+        nabto_device_coap_response_set_content_format(request, CONTENT_FORMAT_APPLICATION_JSON);
+        nabto_device_coap_response_set_payload(request, payload.data(), payload.size());
+        nabto_device_coap_response_ready(request);
+        nabto_device_coap_request_free(request);
+    }
+
+ private:
+    NabtoDevice* device_;
+    IamBenchConfig config_;
+    // synthetic users added to the device so far, only used on the
+    // single worker thread
+    size_t users_ = 0;
+    nabto::common::WorkerPool workerPool_;
+    std::unique_ptr<nabto::common::CoapRequestHandler> coapCheck_;
+};
+
+void signalHandler(int s)
+{
+    printf("Caught signal %d\n", s);
+}
+
+int main(int argc, char** argv)
+{
+    cxxopts::Options options("IAM bench", "Measures how the cost of IAM operations grows with the size of the IAM database.");
+
+    options.add_options("General")
+        ("h,help", "Show help")
+        ("c,config", "Device config file, only used with --check", cxxopts::value<std::string>()->default_value("iam_bench.json"))
+        ("log-level", "Log level to log (error|info|trace|debug)", cxxopts::value<std::string>()->default_value("error"))
+        ("local-port", "Local udp port for direct connections, 0 is ephemeral", cxxopts::value<uint16_t>()->default_value("0"))
+        ("check", "After the offline measurements start the device and measure access checks when a client requests GET /iam-bench/check");
+
+    options.add_options("Database")
+        ("users", "Comma separated list of user counts", cxxopts::value<std::vector<size_t> >()->default_value("10,100,1000,10000"))
+        ("roles", "Number of roles", cxxopts::value<size_t>()->default_value("20"))
+        ("policies", "Number of policies", cxxopts::value<size_t>()->default_value("50"))
+        ("iterations", "Iterations of each timed operation", cxxopts::value<size_t>()->default_value("1000"));
+
+    try {
+        auto result = options.parse(argc, argv);
+
+        if (result.count("help"))
+        {
+            std::cout << options.help({"General", "Database"}) << std::endl;
+            exit(0);
+        }
+
+        IamBenchConfig config;
+        config.userCounts = result["users"].as<std::vector<size_t> >();
+        config.roles = result["roles"].as<size_t>();
+        config.policies = result["policies"].as<size_t>();
+        config.iterations = result["iterations"].as<size_t>();
+        if (config.roles == 0 || config.policies == 0 || config.iterations == 0) {
+            std::cerr << "roles, policies and iterations must be positive" << std::endl;
+            exit(-1);
+        }
+        for (size_t users : config.userCounts) {
+            if (users == 0) {
+                std::cerr << "user counts must be positive" << std::endl;
+                exit(-1);
+            }
+        }
+
+        std::cout << run_offline(config).dump(2) << std::endl;
+
+        if (result.count("check")) {
+            run_iam_bench(result["config"].as<std::string>(),
+                          result["log-level"].as<std::string>(),
+                          result["local-port"].as<uint16_t>(),
+                          config);
+        }
+    } catch (const cxxopts::OptionException& e) {
+        std::cout << "Error parsing options: " << e.what() << std::endl;
+        std::cout << options.help({"General", "Database"}) << std::endl;
+        exit(-1);
+    } catch (const std::domain_error& e) {
+        std::cout << "Error parsing options: " << e.what() << std::endl;
+        std::cout << options.help({"General", "Database"}) << std::endl;
+        exit(-1);
+    }
+    return 0;
+}
+
+void run_iam_bench(const std::string& configFile, const std::string& logLevel, uint16_t localPort, const IamBenchConfig& config)
+{
+    NabtoDeviceError ec;
+    json deviceConfig;
+    if (!json_config_load(configFile, deviceConfig)) {
+        std::cerr << "The config file " << configFile << " does not exists, create it with e.g. stream_echo_device --init" << std::endl;
+        exit(-1);
+    }
+
+    NabtoDevice* device = nabto_device_new();
+
+    auto productId = deviceConfig["ProductId"].get<std::string>();
+    auto deviceId  = deviceConfig["DeviceId"].get<std::string>();
+    auto server = deviceConfig["Server"].get<std::string>();
+    auto privateKey = deviceConfig["PrivateKey"].get<std::string>();
+
+    ec = nabto_device_set_product_id(device, productId.c_str());
+    if (ec) {
+        std::cerr << "Could not set product id" << std::endl;
+    }
+    ec = nabto_device_set_device_id(device, deviceId.c_str());
+    if (ec) {
+        std::cerr << "Could not set device id" << std::endl;
+    }
+    ec = nabto_device_set_server_url(device, server.c_str());
+    if (ec) {
+        std::cerr << "Could not set server url" << std::endl;
+    }
+    ec = nabto_device_set_private_key(device, privateKey.c_str());
+    if (ec) {
+        std::cerr << "Could not set private key" << std::endl;
+    }
+    ec = nabto_device_set_local_port(device, localPort);
+    if (ec) {
+        std::cerr << "Could not set local port" << std::endl;
+    }
+    // policies and roles only, users are added by the checks
+    std::vector<uint8_t> iamCbor = json::to_cbor(synthetic_iam(config, 0));
+    ec = nabto_device_iam_load(device, iamCbor.data(), iamCbor.size());
+    if (ec) {
+        std::cerr << "failed to load iam" << std::endl;
+    }
+    ec = nabto_device_set_log_level(device, logLevel.c_str());
+    if (ec) {
+        std::cerr << "Failed to set loglevel" << std::endl;
+    }
+    ec = nabto_device_set_log_std_out_callback(device);
+    if (ec) {
+        std::cerr << "Failed to enable stdout logging" << std::endl;
+    }
+
+    ec = nabto_device_start(device);
+    if (ec != NABTO_DEVICE_EC_OK) {
+        std::cerr << "Failed to start device" << std::endl;
+        nabto_device_free(device);
+        return;
+    }
+
+    ec = nabto_device_get_local_port(device, &localPort);
+    if (ec == NABTO_DEVICE_EC_OK) {
+        std::cout << "Waiting for GET /iam-bench/check on local port " << localPort << std::endl;
+    }
+
+    {
+        IamBench bench(device, config);
+
+        // Wait for the user to press Ctrl-C
+        struct sigaction sigIntHandler;
+        sigIntHandler.sa_handler = signalHandler;
+        sigemptyset(&sigIntHandler.sa_mask);
+        sigIntHandler.sa_flags = 0;
+        sigaction(SIGINT, &sigIntHandler, NULL);
+
+        pause();
+
+        bench.stop();
+        NabtoDeviceFuture* fut = nabto_device_future_new(device);
+        nabto_device_close(device, fut);
+        nabto_device_future_wait(fut);
+        nabto_device_future_free(fut);
+        nabto_device_stop(device);
+    }
+    nabto_device_free(device);
+}
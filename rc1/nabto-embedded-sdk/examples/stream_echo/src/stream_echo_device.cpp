@@ -2,6 +2,8 @@
 #include <nabto/nabto_device_experimental.h>
 
 #include "json_config.hpp"
+#include "device_config.hpp"
+#include "connection_quota.hpp"
 
 #include <iostream>
 #include <cxxopts.hpp>
@@ -12,7 +14,7 @@
 #include <unistd.h>
 
 static bool init_stream_echo(const std::string& configFile, const std::string& productId, const std::string& deviceId, const std::string& server);
-static void run_stream_echo(const std::string& configFile, const std::string& logLevel);
+static void run_stream_echo(const std::string& configFile, const std::string& logLevel, uint16_t localPort, size_t maxStreams, size_t maxStreamsPerConnection);
 
 
 static NabtoDeviceError allow_anyone_to_connect(NabtoDeviceConnectionRef connectionReference, const char* action, void* attributes, size_t attributesLength, void* userData);
@@ -32,6 +34,11 @@ static void closed(NabtoDeviceFuture* future, NabtoDeviceError ec, void* userDat
 
 struct StreamEchoState {
     NabtoDeviceStream* stream;
+    // the stream counts against the quota of this connection
+    NabtoDeviceConnectionRef connectionRef;
+    // one operation is outstanding at a time, so one future is reused
+    // for accept, read, write and close.
+    NabtoDeviceFuture* future;
     uint8_t readBuffer[1024];
     size_t readLength;
     struct StreamEchoState* next;
@@ -41,6 +48,17 @@ struct StreamEchoState {
 
 struct StreamEchoState head;
 
+// All stream states and their futures are allocated when the device
+// starts, such that memory use is fixed and nothing is allocated by
+// the application while streams are echoing.
+struct StreamEchoState* states = NULL;
+size_t statesCount = 0;
+struct StreamEchoState* freeStates = NULL;
+
+// Streams are limited per connection such that a single client cannot
+// take all the stream states. The total is limited by the states.
+nabto::common::ConnectionQuota* streamQuota = NULL;
+
 void ctrlCHandler(int s){
     printf("Caught signal %d\n",s);
 }
@@ -55,7 +73,10 @@ int main(int argc, char** argv)
         ("h,help", "Show help")
         ("i,init", "Write configuration to the config file and create a a private key")
         ("c,config", "Config file to write to", cxxopts::value<std::string>()->default_value("stream_echo_device.json"))
-        ("log-level", "Log level to log (error|info|trace|debug)", cxxopts::value<std::string>()->default_value("info"));
+        ("log-level", "Log level to log (error|info|trace|debug)", cxxopts::value<std::string>()->default_value("info"))
+        ("local-port", "Local udp port for direct connections, 0 is ephemeral", cxxopts::value<uint16_t>()->default_value("0"))
+        ("max-streams", "Max number of concurrent echo streams, new streams are rejected above this", cxxopts::value<size_t>()->default_value("16"))
+        ("max-streams-per-connection", "Max number of concurrent echo streams from one connection, 0 is no limit", cxxopts::value<size_t>()->default_value("4"));
 
     options.add_options("Init Parameters")
         ("p,product", "Product id", cxxopts::value<std::string>())
@@ -81,7 +102,7 @@ int main(int argc, char** argv)
         } else {
             std::string configFile = result["config"].as<std::string>();
             std::string logLevel = result["log-level"].as<std::string>();
-            run_stream_echo(configFile, logLevel);
+            run_stream_echo(configFile, logLevel, result["local-port"].as<uint16_t>(), result["max-streams"].as<size_t>(), result["max-streams-per-connection"].as<size_t>());
         }
     } catch (const cxxopts::OptionException& e) {
         std::cout << "Error parsing options: " << e.what() << std::endl;
@@ -158,7 +179,37 @@ NabtoDeviceListener* listener;
 NabtoDeviceFuture* listenerFuture;
 bool closing = false;
 
-void run_stream_echo(const std::string& configFile, const std::string& logLevel)
+static bool allocate_states(NabtoDevice* device, size_t maxStreams)
+{
+    states = (struct StreamEchoState*)calloc(maxStreams, sizeof(struct StreamEchoState));
+    if (states == NULL) {
+        return false;
+    }
+    for (size_t i = 0; i < maxStreams; i++) {
+        states[i].future = nabto_device_future_new(device);
+        if (states[i].future == NULL) {
+            return false;
+        }
+        states[i].dev = device;
+        states[i].next = freeStates;
+        freeStates = &states[i];
+        statesCount++;
+    }
+    return true;
+}
+
+static void free_states()
+{
+    for (size_t i = 0; i < statesCount; i++) {
+        nabto_device_future_free(states[i].future);
+    }
+    free(states);
+    states = NULL;
+    statesCount = 0;
+    freeStates = NULL;
+}
+
+void run_stream_echo(const std::string& configFile, const std::string& logLevel, uint16_t localPort, size_t maxStreams, size_t maxStreamsPerConnection)
 {
     NabtoDeviceError ec;
     json config;
@@ -191,6 +242,11 @@ void run_stream_echo(const std::string& configFile, const std::string& logLevel)
         std::cerr << "Could not set private key" << std::endl;
     }
 
+    ec = nabto_device_set_local_port(device, localPort);
+    if (ec) {
+        std::cerr << "Could not set local port" << std::endl;
+    }
+
     ec = nabto_device_enable_mdns(device);
     if (ec) {
         std::cerr << "Failed to enable mdns" << std::endl;
@@ -217,16 +273,27 @@ void run_stream_echo(const std::string& configFile, const std::string& logLevel)
         return;
     }
 
-    char* fpTemp;
-    ec = nabto_device_get_device_fingerprint_hex(device, &fpTemp);
-    if (ec) {
+    std::string fp;
+    if (!device_config_get_fingerprint(device, fp)) {
         std::cerr << "Could not get fingerprint of the device" << std::endl;
     }
-    std::string fp(fpTemp);
-    nabto_device_string_free(fpTemp);
 
     std::cout << "Device " << productId << "." << deviceId << " Started with fingerprint " << std::string(fp) << std::endl;
 
+    // Clients on the same network can connect directly to this port,
+    // this works without the device being attached to a basestation.
+    ec = nabto_device_get_local_port(device, &localPort);
+    if (ec == NABTO_DEVICE_EC_OK) {
+        std::cout << "Accepting direct connections on local port " << localPort << std::endl;
+    }
+
+    if (!allocate_states(device, maxStreams)) {
+        std::cerr << "could not allocate " << maxStreams << " stream states" << std::endl;
+        return;
+    }
+    nabto::common::ConnectionQuota quota(maxStreamsPerConnection, 0);
+    streamQuota = &quota;
+
     listener = nabto_device_listener_new(device);
     if (listener == NULL) {
         std::cerr << "could not listen for streams" << std::endl;
@@ -289,19 +356,23 @@ void run_stream_echo(const std::string& configFile, const std::string& logLevel)
     nabto_device_stop(device);
     nabto_device_future_free(listenerFuture);
     nabto_device_listener_free(listener);
+    free_states();
     nabto_device_free(device);
     return;
 }
 
 void removeState(struct StreamEchoState* state) {
     nabto_device_stream_free(state->stream);
+    streamQuota->release(state->connectionRef);
     struct StreamEchoState* iterator = &head;
     while(iterator->next != state) {
         iterator = iterator->next;
     }
     iterator->next = state->next;
-    state->next = NULL;
-    free(state);
+    state->stream = NULL;
+    state->active = false;
+    state->next = freeStates;
+    freeStates = state;
 }
 
 NabtoDeviceError allow_anyone_to_connect(NabtoDeviceConnectionRef connectionReference, const char* action, void* attributes, size_t attributesLength, void* userData)
@@ -321,17 +392,32 @@ void newEchoStream(NabtoDeviceFuture* future, NabtoDeviceError ec, void* userDat
         return;
     }
     NabtoDevice* device = (NabtoDevice*)userData;
-    struct StreamEchoState* state = (struct StreamEchoState*)calloc(1, sizeof(struct StreamEchoState));
+    struct StreamEchoState* state = freeStates;
+    if (state == NULL) {
+        std::cout << "Rejecting stream, all " << statesCount << " stream states are in use" << std::endl;
+        nabto_device_stream_free(head.stream);
+        head.stream = NULL;
+        startListenForEchoStream(device);
+        return;
+    }
+    NabtoDeviceConnectionRef ref = nabto_device_stream_get_connection_ref(head.stream);
+    if (!streamQuota->acquire(ref)) {
+        std::cout << "Rejecting stream, the connection has too many open streams" << std::endl;
+        nabto_device_stream_free(head.stream);
+        head.stream = NULL;
+        startListenForEchoStream(device);
+        return;
+    }
+    freeStates = state->next;
+    state->connectionRef = ref;
     state->stream = head.stream;
     state->next = head.next;
     head.next = state;
     head.stream = NULL; // ready for next stream
     state->active = true;
-    state->dev = device;
-    NabtoDeviceFuture* acceptFuture = nabto_device_future_new(device);
-    nabto_device_stream_accept(state->stream, acceptFuture);
+    nabto_device_stream_accept(state->stream, state->future);
 
-    nabto_device_future_set_callback(acceptFuture, streamAccepted, state);
+    nabto_device_future_set_callback(state->future, streamAccepted, state);
 
     // listen for next stream
     startListenForEchoStream(device);
@@ -339,7 +425,6 @@ void newEchoStream(NabtoDeviceFuture* future, NabtoDeviceError ec, void* userDat
 
 void streamAccepted(NabtoDeviceFuture* future, NabtoDeviceError ec, void* userData)
 {
-    nabto_device_future_free(future);
     struct StreamEchoState* state = (struct StreamEchoState*)userData;
     if (ec) {
         removeState(state);
@@ -350,14 +435,12 @@ void streamAccepted(NabtoDeviceFuture* future, NabtoDeviceError ec, void* userDa
 
 void startRead(struct StreamEchoState* state)
 {
-    NabtoDeviceFuture* readFuture = nabto_device_future_new(state->dev);
-    nabto_device_stream_read_some(state->stream, readFuture, state->readBuffer, READ_BUFFER_SIZE, &state->readLength);
-    nabto_device_future_set_callback(readFuture, hasRead, state);
+    nabto_device_stream_read_some(state->stream, state->future, state->readBuffer, READ_BUFFER_SIZE, &state->readLength);
+    nabto_device_future_set_callback(state->future, hasRead, state);
 }
 
 void hasRead(NabtoDeviceFuture* future, NabtoDeviceError ec, void* userData)
 {
-    nabto_device_future_free(future);
     struct StreamEchoState* state = (struct StreamEchoState*)userData;
     if (ec == NABTO_DEVICE_EC_EOF) {
         // make a nice shutdown
@@ -374,14 +457,12 @@ void hasRead(NabtoDeviceFuture* future, NabtoDeviceError ec, void* userData)
 
 void startWrite(struct StreamEchoState* state)
 {
-    NabtoDeviceFuture* writeFuture = nabto_device_future_new(state->dev);
-    nabto_device_stream_write(state->stream, writeFuture, state->readBuffer, state->readLength);
-    nabto_device_future_set_callback(writeFuture, wrote, state);
+    nabto_device_stream_write(state->stream, state->future, state->readBuffer, state->readLength);
+    nabto_device_future_set_callback(state->future, wrote, state);
 }
 
 void wrote(NabtoDeviceFuture* future, NabtoDeviceError ec, void* userData)
 {
-    nabto_device_future_free(future);
     struct StreamEchoState* state = (struct StreamEchoState*)userData;
     if (ec != NABTO_DEVICE_EC_OK) {
         // just free the stream, there's no hope for it.
@@ -393,14 +474,12 @@ void wrote(NabtoDeviceFuture* future, NabtoDeviceError ec, void* userData)
 
 void startClose(struct StreamEchoState* state)
 {
-    NabtoDeviceFuture* closeFuture = nabto_device_future_new(state->dev);
-    nabto_device_stream_close(state->stream, closeFuture);
-    nabto_device_future_set_callback(closeFuture, closed, state);
+    nabto_device_stream_close(state->stream, state->future);
+    nabto_device_future_set_callback(state->future, closed, state);
 }
 
 void closed(NabtoDeviceFuture* future, NabtoDeviceError ec, void* userData)
 {
-    nabto_device_future_free(future);
     struct StreamEchoState* state = (struct StreamEchoState*)userData;
 
     // ignore error code, just release the resources.
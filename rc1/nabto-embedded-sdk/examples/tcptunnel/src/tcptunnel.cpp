@@ -1,6 +1,7 @@
 #include "tcptunnel.hpp"
 
 #include "json_config.hpp"
+#include "iam_image.hpp"
 
 #include <nabto/nabto_device_experimental.h>
 
@@ -107,7 +108,13 @@ void TcpTunnel::saveConfig()
     if(nabto_device_iam_dump(device_, &version, buffer.data(), buffer.size(), &used) != NABTO_DEVICE_EC_OK) {
         return;
     }
-    config["Iam"] = json::from_cbor(buffer);
+    buffer.resize(used);
+    if (!iam_image_save(iam_image_file(configFile_), buffer)) {
+        std::cerr << "Could not save the iam image" << std::endl;
+        return;
+    }
+    // the iam is in the image, older configs also have it here
+    config.erase("Iam");
     currentIamVersion_ = version;
 
     json_config_save(configFile_, config);
@@ -1,5 +1,7 @@
 #include "tcptunnel.hpp"
 #include "json_config.hpp"
+#include "device_config.hpp"
+#include "iam_image.hpp"
 
 #include <nabto/nabto_device.h>
 #include <nabto/nabto_device_experimental.h>
@@ -167,7 +169,10 @@ bool init_tcptunnel(const std::string& configFile, const std::string& productId,
         return false;
     }
 
-    config["Iam"] = defaultTcptunnelIam;
+    if (!iam_image_save(iam_image_file(configFile), iamCbor)) {
+        std::cerr << "Error saving the iam image" << std::endl;
+        return false;
+    }
 
     json_config_save(configFile, config);
 
@@ -199,7 +204,6 @@ void run_tcptunnel(const std::string& configFile, const std::string& logLevel)
     auto deviceId  = config["DeviceId"].get<std::string>();
     auto server = config["Server"].get<std::string>();
     auto privateKey = config["PrivateKey"].get<std::string>();
-    auto iam = config["Iam"];
 
 
     ec = nabto_device_set_product_id(device, productId.c_str());
@@ -218,11 +222,14 @@ void run_tcptunnel(const std::string& configFile, const std::string& logLevel)
     if (ec) {
         std::cerr << "Could not set private key" << std::endl;
     }
-    std::vector<uint8_t> iamCbor = json::to_cbor(iam);
-
-    ec = nabto_device_iam_load(device, iamCbor.data(), iamCbor.size());
-    if (ec) {
+    ec = iam_image_load_device(device, configFile, config);
+    if (ec == NABTO_DEVICE_EC_NO_DATA) {
+        std::cerr << "failed to load iam, the config has no iam" << std::endl;
+    } else if (ec) {
+        // do not save an empty iam over the image
         std::cerr << "failed to load iam" << std::endl;
+        nabto_device_free(device);
+        return;
     }
     ec = nabto_device_enable_mdns(device);
     if (ec) {
@@ -259,13 +266,10 @@ void run_tcptunnel(const std::string& configFile, const std::string& logLevel)
         return;
     }
 
-    char* fpTemp;
-    ec = nabto_device_get_device_fingerprint_hex(device, &fpTemp);
-    if (ec) {
+    std::string fp;
+    if (!device_config_get_fingerprint(device, fp)) {
         std::cerr << "Could not get fingerprint of the device" << std::endl;
     }
-    std::string fp(fpTemp);
-    nabto_device_string_free(fpTemp);
 
     std::cout << "Device " << productId << "." << deviceId << " Started with fingerprint " << std::string(fp) << std::endl;
     {